@@ -0,0 +1,177 @@
+/*
+ * LWS table benchmark
+ *
+ * Copyright (C) 2026 Andre Naef
+ *
+ * Measures key hashing and table operations on typical keys. Build from the repository root
+ * against a configured NGINX source tree, e.g.:
+ *
+ *   cc -O2 -Isrc -I$NGINX/objs -I$NGINX/src/core -I$NGINX/src/event -I$NGINX/src/os/unix \
+ *       -o table_bench gen/table_bench.c
+ */
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include "../src/lws_table.c"
+
+
+#define BENCH_ITERATIONS  10000000
+#define BENCH_KEYS        16
+
+
+static double bench_now(void);
+static void bench_hash(int ci);
+static void bench_get(int ci, int hit);
+static void bench_small(int ci);
+
+
+static ngx_log_t   bench_log;
+static ngx_str_t   bench_keys[BENCH_KEYS], bench_misses[BENCH_KEYS];
+static const char *bench_names[BENCH_KEYS] = {
+	"Host", "Accept", "User-Agent", "Accept-Encoding", "Accept-Language", "Content-Type",
+	"Content-Length", "Cookie", "Connection", "X-Forwarded-For", "If-None-Match",
+	"/var/www/lua/main.lua", "/usr/local/nginx/html/app/handlers/session.lua",
+	"/srv/www/static/assets/js/vendor.bundle.min.js", "require", "lws.getbody"
+};
+static volatile ngx_uint_t  bench_sink;
+
+
+/*
+ * NGINX functions used by the table
+ */
+
+void *ngx_alloc (size_t size, ngx_log_t *log) {
+	return malloc(size);
+}
+
+void *ngx_calloc (size_t size, ngx_log_t *log) {
+	return calloc(1, size);
+}
+
+ngx_int_t ngx_strncasecmp (u_char *s1, u_char *s2, size_t n) {
+	ngx_uint_t  c1, c2;
+
+	while (n) {
+		c1 = (ngx_uint_t)*s1++;
+		c2 = (ngx_uint_t)*s2++;
+		c1 = (c1 >= 'A' && c1 <= 'Z') ? (c1 | 0x20) : c1;
+		c2 = (c2 >= 'A' && c2 <= 'Z') ? (c2 | 0x20) : c2;
+		if (c1 != c2) {
+			return c1 - c2;
+		}
+		if (c1 == 0) {
+			return 0;
+		}
+		n--;
+	}
+	return 0;
+}
+
+void ngx_log_error_core (ngx_uint_t level, ngx_log_t *log, ngx_err_t err, const char *fmt, ...) {
+	va_list  args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+
+/*
+ * benchmarks
+ */
+
+static double bench_now (void) {
+	struct timespec  ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_hash (int ci) {
+	size_t       i;
+	double       start;
+	lws_table_t  t;
+
+	ngx_memzero(&t, sizeof(t));
+	t.ci = ci;
+	start = bench_now();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		bench_sink += lws_table_hash(&t, &bench_keys[i % BENCH_KEYS]);
+	}
+	printf("hash ci=%d: %.2f ns/key\n", ci, (bench_now() - start) * 1e9 / BENCH_ITERATIONS);
+}
+
+static void bench_get (int ci, int hit) {
+	size_t        i;
+	double        start;
+	ngx_str_t    *keys;
+	lws_table_t  *t;
+
+	/* request header sized table */
+	t = lws_table_create(32, &bench_log);
+	if (!t) {
+		return;
+	}
+	lws_table_set_ci(t, ci);
+	for (i = 0; i < BENCH_KEYS; i++) {
+		(void)lws_table_set(t, &bench_keys[i], (void *)1);
+	}
+	keys = hit ? bench_keys : bench_misses;
+	start = bench_now();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		bench_sink += (ngx_uint_t)lws_table_get(t, &keys[i % BENCH_KEYS]);
+	}
+	printf("get ci=%d %s: %.2f ns/op\n", ci, hit ? "hit" : "miss",
+			(bench_now() - start) * 1e9 / BENCH_ITERATIONS);
+	lws_table_free(t);
+}
+
+static void bench_small (int ci) {
+	size_t        i, j;
+	double        start;
+	lws_table_t  *t;
+
+	/* response header sized table, created, filled, read, and freed per request */
+	start = bench_now();
+	for (i = 0; i < BENCH_ITERATIONS / 10; i++) {
+		t = lws_table_create(8, &bench_log);
+		if (!t) {
+			return;
+		}
+		lws_table_set_ci(t, ci);
+		for (j = 0; j < 6; j++) {
+			(void)lws_table_set(t, &bench_keys[j], (void *)1);
+		}
+		for (j = 0; j < 6; j++) {
+			bench_sink += (ngx_uint_t)lws_table_get(t, &bench_keys[(i + j) % 6]);
+		}
+		lws_table_free(t);
+	}
+	printf("small ci=%d: %.2f ns/table\n", ci, (bench_now() - start) * 1e9
+			/ (BENCH_ITERATIONS / 10));
+}
+
+int main (void) {
+	int     ci;
+	size_t  i;
+
+	if (lws_table_init_hash(&bench_log) != 0) {
+		return 1;
+	}
+	for (i = 0; i < BENCH_KEYS; i++) {
+		bench_keys[i].data = (u_char *)bench_names[i];
+		bench_keys[i].len = strlen(bench_names[i]);
+		bench_misses[i].data = (u_char *)bench_names[i] + 1;
+		bench_misses[i].len = bench_keys[i].len - 1;
+	}
+	for (ci = 0; ci <= 1; ci++) {
+		bench_hash(ci);
+		bench_get(ci, 1);
+		bench_get(ci, 0);
+		bench_small(ci);
+	}
+	return 0;
+}
@@ -0,0 +1,350 @@
+/*
+ * LWS cache
+ *
+ * Copyright (C) 2026 Andre Naef
+ */
+
+
+#include <lws_cache.h>
+
+
+static ngx_int_t lws_init_cache(ngx_shm_zone_t *zone, void *data);
+static lws_cache_node_t *lws_alloc_cache_node(lws_cache_t *cache, size_t size);
+static void lws_delete_cache_node(lws_cache_t *cache, lws_cache_node_t *node);
+
+
+/*
+ * configuration
+ */
+
+char *lws_cache_zone (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ssize_t          size;
+	ngx_str_t       *values;
+	lws_cache_t     *cache;
+	ngx_shm_zone_t  *zone;
+
+	/* check arguments */
+	values = cf->args->elts;
+	size = ngx_parse_size(&values[2]);
+	if (size == NGX_ERROR) {
+		return "has invalid size";
+	}
+	if (size < (ssize_t)(8 * ngx_pagesize)) {
+		return "has too small size";
+	}
+
+	/* add shared memory zone */
+	cache = ngx_pcalloc(cf->pool, sizeof(lws_cache_t));
+	if (!cache) {
+		return NGX_CONF_ERROR;
+	}
+	zone = ngx_shared_memory_add(cf, &values[1], size, &lws_module);
+	if (!zone) {
+		return NGX_CONF_ERROR;
+	}
+	if (zone->data) {
+		return "is duplicate";
+	}
+	zone->data = cache;
+	zone->init = lws_init_cache;
+	return NGX_CONF_OK;
+}
+
+char *lws_cache (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_str_t                         *values, key;
+	lws_loc_conf_t                    *llcf;
+	ngx_http_compile_complex_value_t   ccv;
+
+	/* set zone; the zone may be defined after its use */
+	llcf = conf;
+	if (llcf->cache != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+	values = cf->args->elts;
+	llcf->cache = ngx_shared_memory_add(cf, &values[1], 0, &lws_module);
+	if (!llcf->cache) {
+		return NGX_CONF_ERROR;
+	}
+
+	/* set key */
+	if (cf->args->nelts >= 3) {
+		key = values[2];
+	} else {
+		ngx_str_set(&key, LWS_CACHE_KEY_DEFAULT);
+	}
+	llcf->cache_key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+	if (!llcf->cache_key) {
+		return NGX_CONF_ERROR;
+	}
+	ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+	ccv.cf = cf;
+	ccv.value = &key;
+	ccv.complex_value = llcf->cache_key;
+	if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+	return NGX_CONF_OK;
+}
+
+static ngx_int_t lws_init_cache (ngx_shm_zone_t *zone, void *data) {
+	lws_cache_t  *cache, *ocache;
+
+	/* reuse on reload */
+	cache = zone->data;
+	ocache = data;
+	if (ocache) {
+		cache->shpool = ocache->shpool;
+		cache->sh = ocache->sh;
+		return NGX_OK;
+	}
+	cache->shpool = (ngx_slab_pool_t *)zone->shm.addr;
+	if (zone->shm.exists) {
+		cache->sh = cache->shpool->data;
+		return NGX_OK;
+	}
+
+	/* create */
+	cache->sh = ngx_slab_alloc(cache->shpool, sizeof(lws_cache_sh_t));
+	if (!cache->sh) {
+		return NGX_ERROR;
+	}
+	cache->shpool->data = cache->sh;
+	cache->shpool->log_nomem = 0;  /* full zones are handled by eviction */
+	ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, ngx_str_rbtree_insert_value);
+	ngx_queue_init(&cache->sh->queue);
+	return NGX_OK;
+}
+
+
+/*
+ * cache
+ */
+
+ngx_int_t lws_get_response_key (ngx_http_request_t *r, lws_loc_conf_t *llcf,
+		ngx_http_complex_value_t *cv, ngx_str_t *key) {
+	u_char     *p;
+	ngx_str_t   value;
+
+	/* evaluate key, appending the response variant as compressed responses are kept
+	   separately */
+	if (ngx_http_complex_value(r, cv, &value) != NGX_OK) {
+		return NGX_ERROR;
+	}
+	p = ngx_pnalloc(r->pool, value.len + 1);
+	if (!p) {
+		return NGX_ERROR;
+	}
+	key->data = p;
+	p = ngx_cpymem(p, value.data, value.len);
+	*p++ = llcf->compress && r == r->main && lws_accept_gzip(r) ? 'z' : '-';
+	key->len = p - key->data;
+	return NGX_OK;
+}
+
+ngx_int_t lws_serve_cached_response (ngx_http_request_t *r, lws_loc_conf_t *llcf,
+		ngx_str_t *key) {
+	u_char            *data;
+	size_t             headers_len, body_len;
+	uint32_t           hash;
+	ngx_uint_t         status, headers_n;
+	lws_cache_t       *cache;
+	ngx_str_node_t    *sn;
+	lws_cache_node_t  *node;
+
+	/* look up entry */
+	cache = llcf->cache->data;
+	hash = ngx_crc32_short(key->data, key->len);
+	ngx_shmtx_lock(&cache->shpool->mutex);
+	sn = ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+	if (!sn) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		return NGX_DECLINED;
+	}
+	node = (lws_cache_node_t *)sn;
+	if (node->expires <= ngx_time()) {
+		lws_delete_cache_node(cache, node);
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		return NGX_DECLINED;
+	}
+	ngx_queue_remove(&node->queue);
+	ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+	/* copy entry, so that the lock is released before sending */
+	data = ngx_pnalloc(r->pool, node->headers_len + node->body_len);
+	if (!data) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+	ngx_memcpy(data, node->data + node->sn.str.len, node->headers_len + node->body_len);
+	status = node->status;
+	headers_n = node->headers_n;
+	headers_len = node->headers_len;
+	body_len = node->body_len;
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+
+	return lws_send_response_copy(r, status, headers_n, data, headers_len, body_len);
+}
+
+void lws_cache_response (lws_request_ctx_t *ctx) {
+	size_t             size, headers_len;
+	uint32_t           hash;
+	ngx_uint_t         headers_n;
+	lws_cache_t       *cache;
+	ngx_str_node_t    *sn;
+	lws_cache_node_t  *node;
+
+	/* size entry; entries above half the zone are not cached */
+	headers_len = lws_get_response_headers_len(ctx, &headers_n);
+	size = offsetof(lws_cache_node_t, data) + ctx->cache_key.len + headers_len
+			+ ctx->response_len;
+	if (size > ctx->llcf->cache->shm.size / 2) {
+		ngx_log_error(NGX_LOG_WARN, ctx->log, 0, "[LWS] response too large to cache size:%uz",
+				size);
+		return;
+	}
+
+	/* allocate entry, replacing a previous entry */
+	cache = ctx->llcf->cache->data;
+	hash = ngx_crc32_short(ctx->cache_key.data, ctx->cache_key.len);
+	ngx_shmtx_lock(&cache->shpool->mutex);
+	sn = ngx_str_rbtree_lookup(&cache->sh->rbtree, &ctx->cache_key, hash);
+	if (sn) {
+		lws_delete_cache_node(cache, (lws_cache_node_t *)sn);
+	}
+	node = lws_alloc_cache_node(cache, size);
+	if (!node) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "[LWS] failed to allocate cache entry");
+		return;
+	}
+
+	/* fill entry */
+	node->expires = ngx_time() + ctx->cache_ttl;
+	node->status = ctx->status;
+	node->headers_n = headers_n;
+	node->headers_len = headers_len;
+	node->body_len = ctx->response_len;
+	node->sn.str.data = node->data;
+	node->sn.str.len = ctx->cache_key.len;
+	lws_copy_response(ctx, ngx_cpymem(node->data, ctx->cache_key.data, ctx->cache_key.len));
+
+	/* insert entry */
+	node->sn.node.key = hash;
+	ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
+	ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+static lws_cache_node_t *lws_alloc_cache_node (lws_cache_t *cache, size_t size) {
+	ngx_queue_t       *q;
+	lws_cache_node_t  *node;
+
+	/* evict least recently used entries until the entry fits */
+	while (1) {
+		node = ngx_slab_alloc_locked(cache->shpool, size);
+		if (node) {
+			return node;
+		}
+		if (ngx_queue_empty(&cache->sh->queue)) {
+			return NULL;
+		}
+		q = ngx_queue_last(&cache->sh->queue);
+		lws_delete_cache_node(cache, ngx_queue_data(q, lws_cache_node_t, queue));
+	}
+}
+
+static void lws_delete_cache_node (lws_cache_t *cache, lws_cache_node_t *node) {
+	ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+	ngx_queue_remove(&node->queue);
+	ngx_slab_free_locked(cache->shpool, node);
+}
+
+
+/*
+ * response copies
+ */
+
+size_t lws_get_response_headers_len (lws_request_ctx_t *ctx, ngx_uint_t *headers_n) {
+	size_t      len;
+	ngx_str_t  *key, *value;
+
+	*headers_n = 0;
+	len = 0;
+	key = NULL;
+	while (lws_table_next(ctx->response_headers, key, &key, (void**)&value) == 0) {
+		(*headers_n)++;
+		len += 2 * sizeof(size_t) + key->len + value->len;
+	}
+	return len;
+}
+
+u_char *lws_copy_response (lws_request_ctx_t *ctx, u_char *p) {
+	ngx_str_t    *key, *value;
+	ngx_chain_t  *cl;
+
+	/* serialize headers, followed by the body */
+	key = NULL;
+	while (lws_table_next(ctx->response_headers, key, &key, (void**)&value) == 0) {
+		p = ngx_cpymem(p, &key->len, sizeof(size_t));
+		p = ngx_cpymem(p, &value->len, sizeof(size_t));
+		p = ngx_cpymem(p, key->data, key->len);
+		p = ngx_cpymem(p, value->data, value->len);
+	}
+	for (cl = ctx->response_cl; cl; cl = cl->next) {
+		p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+	}
+	return p;
+}
+
+ngx_int_t lws_send_response_copy (ngx_http_request_t *r, ngx_uint_t status, ngx_uint_t headers_n,
+		u_char *data, size_t headers_len, size_t body_len) {
+	u_char       *p;
+	ngx_int_t     rc;
+	ngx_str_t     name, value;
+	ngx_buf_t    *b;
+	ngx_uint_t    i;
+	ngx_chain_t   out;
+
+	/* set headers; the copy is owned by the request */
+	rc = ngx_http_discard_request_body(r);
+	if (rc != NGX_OK) {
+		return rc;
+	}
+	p = data;
+	for (i = 0; i < headers_n; i++) {
+		ngx_memcpy(&name.len, p, sizeof(size_t));
+		p += sizeof(size_t);
+		ngx_memcpy(&value.len, p, sizeof(size_t));
+		p += sizeof(size_t);
+		name.data = p;
+		p += name.len;
+		value.data = p;
+		p += value.len;
+		if (lws_push_response_header(r, &name, &value) != NGX_OK) {
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+	}
+
+	/* send response */
+	r->headers_out.status = status;
+	r->headers_out.content_length_n = body_len;
+	r->disable_not_modified = 1;
+	rc = ngx_http_send_header(r);
+	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+		return rc;
+	}
+	b = ngx_calloc_buf(r->pool);
+	if (!b) {
+		return NGX_ERROR;
+	}
+	if (body_len > 0) {
+		b->pos = data + headers_len;
+		b->last = b->pos + body_len;
+		b->memory = 1;
+	}
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+	out.buf = b;
+	out.next = NULL;
+	return ngx_http_output_filter(r, &out);
+}
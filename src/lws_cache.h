@@ -0,0 +1,64 @@
+/*
+ * LWS cache
+ *
+ * Copyright (C) 2026 Andre Naef
+ */
+
+
+#ifndef _LWS_CACHE_INCLUDED
+#define _LWS_CACHE_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define LWS_CACHE_KEY_DEFAULT  "$scheme$host$request_uri"
+#define LWS_CACHE_TTL_MAX      31536000  /* one year [s] */
+
+
+typedef struct lws_cache_s lws_cache_t;
+typedef struct lws_cache_sh_s lws_cache_sh_t;
+typedef struct lws_cache_node_s lws_cache_node_t;
+
+
+#include <lws_module.h>
+
+
+struct lws_cache_sh_s {
+	ngx_rbtree_t       rbtree;    /* entries by key */
+	ngx_rbtree_node_t  sentinel;  /* sentinel */
+	ngx_queue_t        queue;     /* entries in LRU order */
+};
+
+struct lws_cache_s {
+	ngx_slab_pool_t  *shpool;  /* shared memory pool */
+	lws_cache_sh_t   *sh;      /* shared state */
+};
+
+struct lws_cache_node_s {
+	ngx_str_node_t  sn;           /* rbtree node with key */
+	ngx_queue_t     queue;        /* LRU queue */
+	time_t          expires;      /* expiry time */
+	ngx_uint_t      status;       /* HTTP response status */
+	ngx_uint_t      headers_n;    /* number of HTTP response headers */
+	size_t          headers_len;  /* length of serialized HTTP response headers */
+	size_t          body_len;     /* length of HTTP response body */
+	u_char          data[1];      /* key, headers, and body */
+};
+
+
+char *lws_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *lws_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t lws_get_response_key(ngx_http_request_t *r, lws_loc_conf_t *llcf,
+		ngx_http_complex_value_t *cv, ngx_str_t *key);
+ngx_int_t lws_serve_cached_response(ngx_http_request_t *r, lws_loc_conf_t *llcf, ngx_str_t *key);
+void lws_cache_response(lws_request_ctx_t *ctx);
+size_t lws_get_response_headers_len(lws_request_ctx_t *ctx, ngx_uint_t *headers_n);
+u_char *lws_copy_response(lws_request_ctx_t *ctx, u_char *p);
+ngx_int_t lws_send_response_copy(ngx_http_request_t *r, ngx_uint_t status, ngx_uint_t headers_n,
+		u_char *data, size_t headers_len, size_t body_len);
+
+
+#endif /* _LWS_CACHE_INCLUDED */
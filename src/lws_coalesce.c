@@ -0,0 +1,197 @@
+/*
+ * LWS coalesce
+ *
+ * Copyright (C) 2026 Andre Naef
+ */
+
+
+#include <lws_coalesce.h>
+
+
+static void lws_release_followers(ngx_queue_t *followers);
+static void lws_release_handler(ngx_event_t *ev);
+static void lws_cleanup_follower(void *data);
+
+
+/*
+ * coalescing
+ */
+
+ngx_int_t lws_follow_request (ngx_http_request_t *r, lws_loc_conf_t *llcf, ngx_str_t *key,
+		ngx_str_t *cache_key) {
+	ngx_http_cleanup_t  *cln;
+	lws_follower_t      *f;
+	lws_request_ctx_t   *leader;
+
+	/* find leader */
+	leader = lws_table_get(llcf->coalesce, key);
+	if (!leader) {
+		return NGX_DECLINED;
+	}
+
+	/* follow; the request waits on the event loop without a Lua state */
+	f = ngx_pcalloc(r->pool, sizeof(lws_follower_t));
+	if (!f) {
+		ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "[LWS] failed to allocate follower");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+	cln = ngx_http_cleanup_add(r, 0);
+	if (!cln) {
+		ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0, "[LWS] failed to add follower cleanup");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+	cln->handler = lws_cleanup_follower;
+	cln->data = f;
+	f->r = r;
+	f->leader = leader;
+	f->key = *key;
+	f->cache_key = *cache_key;
+	ngx_queue_init(&f->followers);
+	f->ev.data = f;
+	f->ev.handler = lws_release_handler;
+	f->ev.log = r->connection->log;
+	ngx_queue_insert_tail(&leader->followers, &f->queue);
+
+	/* prune the request if the client disconnects while waiting */
+	r->read_event_handler = ngx_http_test_reading;
+	if (ngx_handle_read_event(r->connection->read, 0) != NGX_OK) {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "[LWS] failed to handle read event");
+	}
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[LWS] request coalesced key:%V",
+			key);
+	r->main->count++;
+	return NGX_DONE;
+}
+
+ngx_int_t lws_lead_request (lws_request_ctx_t *ctx, ngx_str_t *key) {
+	ngx_queue_init(&ctx->followers);
+	if (lws_table_set(ctx->llcf->coalesce, key, ctx) != 0) {
+		ngx_log_error(NGX_LOG_CRIT, ctx->log, 0, "[LWS] failed to register coalescing leader");
+		return NGX_ERROR;
+	}
+	ctx->coalesce_key = *key;
+	return NGX_OK;
+}
+
+void lws_complete_coalesced_requests (lws_request_ctx_t *ctx, ngx_uint_t share) {
+	u_char              *p;
+	size_t               headers_len, len;
+	ngx_int_t            rc;
+	ngx_uint_t           headers_n;
+	ngx_queue_t         *q;
+	lws_follower_t      *f;
+	ngx_connection_t    *c;
+	ngx_http_request_t  *r;
+
+	/* retire leader, so that new requests lead again */
+	if (!ctx->coalesce_key.len) {
+		return;
+	}
+	(void)lws_table_set(ctx->llcf->coalesce, &ctx->coalesce_key, NULL);
+	ngx_str_null(&ctx->coalesce_key);
+	if (ngx_queue_empty(&ctx->followers)) {
+		return;
+	}
+
+	/* release followers to run again under a new leader */
+	if (!share) {
+		lws_release_followers(&ctx->followers);
+		return;
+	}
+
+	/* send followers a copy, sizing the serialized response once */
+	headers_n = 0;
+	headers_len = lws_get_response_headers_len(ctx, &headers_n);
+	len = headers_len + ctx->response_len;
+	while (!ngx_queue_empty(&ctx->followers)) {
+		q = ngx_queue_head(&ctx->followers);
+		f = ngx_queue_data(q, lws_follower_t, queue);
+		ngx_queue_remove(q);
+		f->leader = NULL;
+		r = f->r;
+		r->read_event_handler = ngx_http_block_reading;
+		c = r->connection;
+		p = ngx_pnalloc(r->pool, len);
+		if (p) {
+			lws_copy_response(ctx, p);
+			rc = lws_send_response_copy(r, ctx->status, headers_n, p, headers_len,
+					ctx->response_len);
+		} else {
+			ngx_log_error(NGX_LOG_CRIT, c->log, 0, "[LWS] failed to copy coalesced response");
+			rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+		ngx_http_finalize_request(r, rc);
+		ngx_http_run_posted_requests(c);
+	}
+}
+
+static void lws_release_followers (ngx_queue_t *followers) {
+	ngx_queue_t     *q;
+	lws_follower_t  *f;
+
+	/* the first follower runs and leads the others, so that still only one request per key
+	   runs Lua */
+	if (ngx_queue_empty(followers)) {
+		return;
+	}
+	q = ngx_queue_head(followers);
+	f = ngx_queue_data(q, lws_follower_t, queue);
+	ngx_queue_remove(q);
+	f->leader = NULL;
+	f->r->read_event_handler = ngx_http_block_reading;
+	if (!ngx_queue_empty(followers)) {
+		ngx_queue_add(&f->followers, followers);
+		ngx_queue_init(followers);
+	}
+	ngx_post_event(&f->ev, &ngx_posted_events);
+}
+
+static void lws_release_handler (ngx_event_t *ev) {
+	ngx_int_t            rc;
+	ngx_queue_t         *q;
+	lws_follower_t      *f, *next;
+	lws_loc_conf_t      *llcf;
+	ngx_connection_t    *c;
+	lws_request_ctx_t   *ctx;
+	ngx_http_request_t  *r;
+
+	/* run the request as if newly arrived, leading the remaining followers */
+	f = ev->data;
+	r = f->r;
+	c = r->connection;
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "[LWS] coalesced request released");
+	llcf = ngx_http_get_module_loc_conf(r, lws_module);
+	rc = lws_start_request(r, llcf, &f->cache_key, &f->key);
+
+	/* hand over the followers, or release them to the next follower if not leading */
+	if (!ngx_queue_empty(&f->followers)) {
+		ctx = ngx_http_get_module_ctx(r, lws_module);
+		if (ctx && ctx->coalesce_key.len) {
+			for (q = ngx_queue_head(&f->followers); q != ngx_queue_sentinel(&f->followers);
+					q = ngx_queue_next(q)) {
+				next = ngx_queue_data(q, lws_follower_t, queue);
+				next->leader = ctx;
+			}
+			ngx_queue_add(&ctx->followers, &f->followers);
+			ngx_queue_init(&f->followers);
+		} else {
+			lws_release_followers(&f->followers);
+		}
+	}
+	ngx_http_finalize_request(r, rc);
+	ngx_http_run_posted_requests(c);
+}
+
+static void lws_cleanup_follower (void *data) {
+	lws_follower_t  *f;
+
+	f = data;
+	if (f->leader) {
+		ngx_queue_remove(&f->queue);
+		f->leader = NULL;
+	}
+	if (f->ev.posted) {
+		ngx_delete_posted_event(&f->ev);
+	}
+	lws_release_followers(&f->followers);  /* released, but gone before leading */
+}
@@ -0,0 +1,40 @@
+/*
+ * LWS coalesce
+ *
+ * Copyright (C) 2026 Andre Naef
+ */
+
+
+#ifndef _LWS_COALESCE_INCLUDED
+#define _LWS_COALESCE_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct lws_follower_s lws_follower_t;
+
+
+#include <lws_module.h>
+
+
+struct lws_follower_s {
+	ngx_queue_t          queue;      /* followers of leader */
+	ngx_http_request_t  *r;          /* NGINX HTTP request */
+	lws_request_ctx_t   *leader;     /* leading request context; NULL = completed or released */
+	ngx_str_t            key;        /* coalescing key */
+	ngx_str_t            cache_key;  /* HTTP response cache key */
+	ngx_queue_t          followers;  /* followers to hand over once released to lead */
+	ngx_event_t          ev;         /* release event */
+};
+
+
+ngx_int_t lws_follow_request(ngx_http_request_t *r, lws_loc_conf_t *llcf, ngx_str_t *key,
+		ngx_str_t *cache_key);
+ngx_int_t lws_lead_request(lws_request_ctx_t *ctx, ngx_str_t *key);
+void lws_complete_coalesced_requests(lws_request_ctx_t *ctx, ngx_uint_t share);
+
+
+#endif /* _LWS_COALESCE_INCLUDED */
@@ -0,0 +1,403 @@
+/*
+ * LWS compress
+ *
+ * Copyright (C) 2026 Andre Naef
+ */
+
+
+#include <zlib.h>
+#include <lws_compress.h>
+
+
+struct lws_compress_s {
+	z_stream      zs;                            /* zlib stream */
+	ngx_fd_t      fd;                            /* output pipe; invalid = output chunks */
+	ngx_chain_t  *out;                           /* output chunks */
+	ngx_chain_t  *last;                          /* last output chunk */
+	size_t        len;                           /* output length */
+	u_char        buf[LWS_RESPONSE_CHUNK_SIZE];  /* output buffer for pipe */
+};
+
+
+static int lws_accept_gzip_value(ngx_str_t *value);
+static int lws_accept_gzip_quality(u_char *pos, u_char *last);
+static int lws_is_compressible(lws_request_ctx_t *ctx);
+static lws_compress_t *lws_create_compression(lws_request_ctx_t *ctx, ngx_fd_t fd);
+static int lws_deflate(lws_request_ctx_t *ctx, u_char *data, size_t size, int flush);
+static int lws_write_output(ngx_fd_t fd, u_char *data, size_t size);
+static int lws_set_vary_header(lws_request_ctx_t *ctx);
+static int lws_set_compression_headers(lws_request_ctx_t *ctx);
+static int lws_set_response_header_value(lws_table_t *t, ngx_str_t *key, ngx_str_t *value);
+
+
+/*
+ * negotiation
+ */
+
+int lws_accept_gzip (ngx_http_request_t *r) {
+	int               accept;
+	ngx_uint_t        i;
+	ngx_list_part_t  *part;
+	ngx_table_elt_t  *headers;
+
+	/* the field may be split over several header lines */
+	for (part = &r->headers_in.headers.part; part; part = part->next) {
+		headers = part->elts;
+		for (i = 0; i < part->nelts; i++) {
+			if (headers[i].key.len == sizeof("Accept-Encoding") - 1
+					&& ngx_strncasecmp(headers[i].key.data, (u_char *)"Accept-Encoding",
+					sizeof("Accept-Encoding") - 1) == 0) {
+				accept = lws_accept_gzip_value(&headers[i].value);
+				if (accept >= 0) {
+					return accept;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int lws_accept_gzip_value (ngx_str_t *value) {
+	u_char  *pos, *last, *end;
+
+	/* find gzip token; -1 = none */
+	pos = value->data;
+	last = value->data + value->len;
+	while (pos < last) {
+		while (pos < last && (*pos == ' ' || *pos == '\t' || *pos == ',')) {
+			pos++;
+		}
+		end = pos;
+		while (end < last && *end != ',' && *end != ';' && *end != ' ' && *end != '\t') {
+			end++;
+		}
+		if (end - pos == sizeof("gzip") - 1
+				&& ngx_strncasecmp(pos, (u_char *)"gzip", sizeof("gzip") - 1) == 0) {
+			return lws_accept_gzip_quality(end, last);
+		}
+		while (end < last && *end != ',') {
+			end++;
+		}
+		pos = end;
+	}
+	return -1;
+}
+
+static int lws_accept_gzip_quality (u_char *pos, u_char *last) {
+	/* parameters of gzip token */
+	while (pos < last && (*pos == ' ' || *pos == '\t')) {
+		pos++;
+	}
+	if (pos == last || *pos == ',') {
+		return 1;
+	}
+	if (*pos != ';') {
+		return 0;
+	}
+
+	/* check for zero quality, i.e., q=0 with optional zero decimals */
+	pos++;
+	while (pos < last && (*pos == ' ' || *pos == '\t')) {
+		pos++;
+	}
+	if (last - pos < 3 || (pos[0] != 'q' && pos[0] != 'Q') || pos[1] != '=' || pos[2] != '0') {
+		return 1;
+	}
+	pos += 3;
+	if (pos < last && *pos == '.') {
+		pos++;
+		while (pos < last && *pos == '0') {
+			pos++;
+		}
+	}
+	return pos < last && *pos >= '1' && *pos <= '9';
+}
+
+static int lws_is_compressible (lws_request_ctx_t *ctx) {
+	ngx_str_t  key = ngx_string("Content-Encoding");
+
+	if (ctx->status < NGX_HTTP_OK || ctx->status == NGX_HTTP_NO_CONTENT
+			|| ctx->status == NGX_HTTP_NOT_MODIFIED) {
+		return 0;
+	}
+	return lws_table_get(ctx->response_headers, &key) == NULL;
+}
+
+
+/*
+ * compression
+ */
+
+int lws_open_compression_stream (lws_request_ctx_t *ctx) {
+	unsigned  compress;
+
+	/* decided once, when the response is sealed */
+	compress = ctx->compress;
+	ctx->compress = 0;
+	if (!ctx->vary) {
+		return 0;
+	}
+	ctx->vary = 0;
+	if (!lws_is_compressible(ctx)) {
+		return 0;
+	}
+	if (lws_set_vary_header(ctx) != 0) {
+		return -1;
+	}
+	if (!compress) {
+		return 0;
+	}
+	ctx->compression = lws_create_compression(ctx, ctx->streaming_pipe[1]);
+	if (!ctx->compression) {
+		return -1;
+	}
+	return lws_set_compression_headers(ctx);
+}
+
+int lws_write_compression_stream (lws_request_ctx_t *ctx, u_char *data, size_t size, int flush) {
+	return lws_deflate(ctx, data, size, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+}
+
+int lws_compress_response_body (lws_request_ctx_t *ctx) {
+	int              rc;
+	ngx_chain_t     *cl, *next;
+	lws_compress_t  *c;
+
+	/* finish streamed response; on failure, the response is aborted rather than ended */
+	if (ctx->compression) {
+		rc = lws_deflate(ctx, NULL, 0, Z_FINISH);
+		lws_free_compression(ctx);
+		if (rc != 0) {
+			ctx->compression_rc = NGX_ERROR;
+		}
+		return rc;
+	}
+
+	/* check buffered response; the response varies by encoding even if not compressed */
+	if (!ctx->vary || ctx->rc != 0 || ctx->redirect.len || ctx->sendfile.len
+			|| !lws_is_compressible(ctx)) {
+		return 0;
+	}
+	if (lws_set_vary_header(ctx) != 0) {
+		return -1;
+	}
+	if (!ctx->compress) {
+		return 0;
+	}
+	if (fflush(ctx->response_body) != 0) {
+		ngx_log_error(NGX_LOG_CRIT, ctx->log, errno, "[LWS] failed to flush response body");
+		return -1;
+	}
+	if (ctx->response_file.fd != NGX_INVALID_FILE || ctx->response_len < LWS_COMPRESS_MIN_LENGTH) {
+		return 0;  /* spilled bodies are sent from their file as is */
+	}
+
+	/* compress into new chunks */
+	ctx->compression = lws_create_compression(ctx, NGX_INVALID_FILE);
+	if (!ctx->compression) {
+		return -1;
+	}
+	for (cl = ctx->response_cl; cl; cl = cl->next) {
+		if (lws_deflate(ctx, cl->buf->pos, cl->buf->last - cl->buf->pos,
+				cl->next ? Z_NO_FLUSH : Z_FINISH) != 0) {
+			lws_free_compression(ctx);
+			return -1;
+		}
+	}
+	c = ctx->compression;
+	if (c->len >= ctx->response_len) {
+		lws_free_compression(ctx);  /* incompressible */
+		return 0;
+	}
+	if (lws_set_compression_headers(ctx) != 0) {
+		lws_free_compression(ctx);
+		return -1;
+	}
+
+	/* replace chunks */
+	for (cl = ctx->response_cl; cl; cl = next) {
+		next = cl->next;
+		ngx_free(cl);
+	}
+	ctx->response_cl = c->out;
+	ctx->response_last = c->last;
+	ctx->response_len = c->len;
+	c->out = NULL;
+	c->last = NULL;
+	lws_free_compression(ctx);
+	return 0;
+}
+
+void lws_free_compression (lws_request_ctx_t *ctx) {
+	ngx_chain_t     *cl, *next;
+	lws_compress_t  *c;
+
+	c = ctx->compression;
+	if (!c) {
+		return;
+	}
+	(void)deflateEnd(&c->zs);
+	for (cl = c->out; cl; cl = next) {
+		next = cl->next;
+		ngx_free(cl);
+	}
+	ngx_free(c);
+	ctx->compression = NULL;
+}
+
+static lws_compress_t *lws_create_compression (lws_request_ctx_t *ctx, ngx_fd_t fd) {
+	lws_compress_t  *c;
+
+	c = ngx_alloc(sizeof(lws_compress_t), ctx->log);
+	if (!c) {
+		return NULL;
+	}
+	ngx_memzero(&c->zs, sizeof(z_stream));
+	if (deflateInit2(&c->zs, (int)ctx->llcf->compress_level, Z_DEFLATED, MAX_WBITS + 16,
+			MAX_MEM_LEVEL - 1, Z_DEFAULT_STRATEGY) != Z_OK) {
+		ngx_log_error(NGX_LOG_CRIT, ctx->log, 0, "[LWS] failed to initialize compression");
+		ngx_free(c);
+		return NULL;
+	}
+	c->fd = fd;
+	c->out = NULL;
+	c->last = NULL;
+	c->len = 0;
+	return c;
+}
+
+static int lws_deflate (lws_request_ctx_t *ctx, u_char *data, size_t size, int flush) {
+	size_t           n;
+	ngx_buf_t       *b;
+	ngx_chain_t     *cl;
+	lws_compress_t  *c;
+
+	c = ctx->compression;
+	c->zs.next_in = data;
+	c->zs.avail_in = size;
+	do {
+		/* provide output space */
+		if (c->fd != NGX_INVALID_FILE) {
+			c->zs.next_out = c->buf;
+			c->zs.avail_out = sizeof(c->buf);
+		} else {
+			if (!c->last || c->last->buf->last == c->last->buf->end) {
+				cl = lws_alloc_response_chunk(ctx->log);
+				if (!cl) {
+					return -1;
+				}
+				if (c->last) {
+					c->last->next = cl;
+				} else {
+					c->out = cl;
+				}
+				c->last = cl;
+			}
+			b = c->last->buf;
+			c->zs.next_out = b->last;
+			c->zs.avail_out = b->end - b->last;
+		}
+
+		/* deflate */
+		n = c->zs.avail_out;
+		if (deflate(&c->zs, flush) == Z_STREAM_ERROR) {
+			ngx_log_error(NGX_LOG_CRIT, ctx->log, 0, "[LWS] failed to compress response body");
+			return -1;
+		}
+		n -= c->zs.avail_out;
+
+		/* consume output */
+		if (c->fd != NGX_INVALID_FILE) {
+			if (lws_write_output(c->fd, c->buf, n) != 0) {
+				ngx_log_error(NGX_LOG_ERR, ctx->log, errno, "[LWS] failed to write response");
+				return -1;
+			}
+		} else {
+			c->last->buf->last += n;
+		}
+		c->len += n;
+	} while (c->zs.avail_out == 0);
+	return 0;
+}
+
+static int lws_write_output (ngx_fd_t fd, u_char *data, size_t size) {
+	size_t   written;
+	ssize_t  n;
+
+	for (written = 0; written < size; ) {
+		n = write(fd, data + written, size - written);
+		if (n > 0) {
+			written += n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * headers
+ */
+
+static int lws_set_vary_header (lws_request_ctx_t *ctx) {
+	ngx_str_t  vary = ngx_string("Vary"), accept = ngx_string("Accept-Encoding");
+
+	/* like gzip_vary, for any response that may be compressed */
+	if (!lws_table_get(ctx->response_headers, &vary)
+			&& lws_set_response_header_value(ctx->response_headers, &vary, &accept) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int lws_set_compression_headers (lws_request_ctx_t *ctx) {
+	ngx_str_t  encoding = ngx_string("Content-Encoding"), gzip = ngx_string("gzip");
+	ngx_str_t  etag_key = ngx_string("ETag"), *etag, *weak;
+
+	/* weaken strong ETag, as the encodings differ; like ngx_http_weak_etag */
+	etag = lws_table_get(ctx->response_headers, &etag_key);
+	if (etag && !(etag->len > 2 && etag->data[0] == 'W' && etag->data[1] == '/')) {
+		if (etag->len < 1 || etag->data[0] != '"') {
+			(void)lws_table_set(ctx->response_headers, &etag_key, NULL);
+		} else {
+			weak = ngx_alloc(sizeof(ngx_str_t) + 2 + etag->len, ctx->log);
+			if (!weak) {
+				return -1;
+			}
+			weak->data = (u_char *)weak + sizeof(ngx_str_t);
+			weak->data[0] = 'W';
+			weak->data[1] = '/';
+			ngx_memcpy(weak->data + 2, etag->data, etag->len);
+			weak->len = 2 + etag->len;
+			if (lws_table_set(ctx->response_headers, &etag_key, weak) != 0) {
+				ngx_free(weak);
+				return -1;
+			}
+		}
+	}
+
+	/* set last, so that a failure leaves the response labeled as uncompressed */
+	return lws_set_response_header_value(ctx->response_headers, &encoding, &gzip);
+}
+
+static int lws_set_response_header_value (lws_table_t *t, ngx_str_t *key, ngx_str_t *value) {
+	ngx_str_t  *dup;
+
+	/* same layout as values set from Lua */
+	dup = ngx_alloc(sizeof(ngx_str_t) + value->len, t->log);
+	if (!dup) {
+		return -1;
+	}
+	dup->data = (u_char *)dup + sizeof(ngx_str_t);
+	ngx_memcpy(dup->data, value->data, value->len);
+	dup->len = value->len;
+	if (lws_table_set(t, key, dup) != 0) {
+		ngx_free(dup);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * LWS compress
+ *
+ * Copyright (C) 2026 Andre Naef
+ */
+
+
+#ifndef _LWS_COMPRESS_INCLUDED
+#define _LWS_COMPRESS_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define LWS_COMPRESS_LEVEL_DEFAULT  1
+#define LWS_COMPRESS_MIN_LENGTH     256
+
+
+typedef struct lws_compress_s lws_compress_t;
+
+
+#include <lws_module.h>
+
+
+int lws_accept_gzip(ngx_http_request_t *r);
+int lws_open_compression_stream(lws_request_ctx_t *ctx);
+int lws_write_compression_stream(lws_request_ctx_t *ctx, u_char *data, size_t size, int flush);
+int lws_compress_response_body(lws_request_ctx_t *ctx);
+void lws_free_compression(lws_request_ctx_t *ctx);
+
+
+#endif /* _LWS_COMPRESS_INCLUDED */
@@ -0,0 +1,436 @@
+/*
+ * LWS executor
+ *
+ * Copyright (C) 2026 Andre Naef
+ */
+
+
+#include <lws_executor.h>
+
+
+typedef struct lws_executor_slot_s lws_executor_slot_t;
+typedef struct lws_executor_queue_s lws_executor_queue_t;
+typedef struct lws_executor_thread_s lws_executor_thread_t;
+
+struct lws_executor_slot_s {
+	ngx_atomic_t        seq;   /* sequence; see lws_push_queue and lws_pop_queue */
+	ngx_thread_task_t  *task;  /* task */
+};
+
+struct lws_executor_queue_s {
+	ngx_atomic_t          head;   /* consumer position; shared by owner and thieves */
+	ngx_atomic_uint_t     tail;   /* producer position; event loop only */
+	lws_executor_slot_t  *slots;  /* slots */
+};
+
+struct lws_executor_thread_s {
+	lws_executor_t        *ex;     /* executor */
+	ngx_uint_t             index;  /* thread index */
+	pthread_t              tid;    /* thread ID */
+	lws_executor_queue_t   queue;  /* run queue */
+};
+
+struct lws_executor_s {
+	ngx_log_t              *log;          /* log */
+	ngx_uint_t              threads_n;    /* number of threads */
+	ngx_uint_t              started_n;    /* number of started threads */
+	ngx_uint_t              queue_mask;   /* run queue size - 1; size is a power of two */
+	ngx_uint_t              next;         /* next thread for tasks without affinity */
+	lws_executor_thread_t  *threads;      /* threads */
+	ngx_atomic_t            pending;      /* posted tasks not yet taken */
+	ngx_atomic_t            idle;         /* idle threads */
+	ngx_thread_mutex_t      mutex;        /* mutex for idle threads */
+	ngx_thread_cond_t       cond;         /* condition for idle threads */
+	ngx_thread_mutex_t      done_mutex;   /* mutex for done tasks */
+	ngx_thread_task_t      *done_first;   /* first done task */
+	ngx_thread_task_t     **done_last;    /* last done task */
+	ngx_fd_t                notify[2];    /* notification pipe */
+	ngx_connection_t       *notify_conn;  /* notification connection */
+	ngx_uint_t              exiting;      /* executor is exiting */
+};
+
+
+static ngx_int_t lws_push_queue(lws_executor_queue_t *q, ngx_uint_t mask,
+		ngx_thread_task_t *task);
+static ngx_thread_task_t *lws_pop_queue(lws_executor_queue_t *q, ngx_uint_t mask);
+static ngx_thread_task_t *lws_take_task(lws_executor_t *ex, ngx_uint_t index);
+static void lws_complete_task(lws_executor_t *ex, ngx_thread_task_t *task);
+static void *lws_executor_thread(void *data);
+static void lws_executor_handler(ngx_event_t *ev);
+
+
+/*
+ * The run queues are bounded multi-consumer queues with a single producer, the event loop. Each
+ * slot carries a sequence number that tells whether the slot is free for the producer at a
+ * given position, or holds a task for the consumers at that position. Consumers claim a
+ * position by advancing the head with a compare-and-set, so the owning thread and thieves can
+ * take tasks from the same queue without a lock.
+ */
+
+static ngx_int_t lws_push_queue (lws_executor_queue_t *q, ngx_uint_t mask,
+		ngx_thread_task_t *task) {
+	lws_executor_slot_t  *slot;
+
+	slot = &q->slots[q->tail & mask];
+	if (slot->seq != q->tail) {
+		return NGX_AGAIN;  /* full */
+	}
+	slot->task = task;
+	ngx_memory_barrier();
+	slot->seq = q->tail + 1;
+	q->tail++;
+	return NGX_OK;
+}
+
+static ngx_thread_task_t *lws_pop_queue (lws_executor_queue_t *q, ngx_uint_t mask) {
+	ngx_atomic_int_t      diff;
+	ngx_atomic_uint_t     pos;
+	ngx_thread_task_t    *task;
+	lws_executor_slot_t  *slot;
+
+	for ( ;; ) {
+		pos = q->head;
+		slot = &q->slots[pos & mask];
+		ngx_memory_barrier();
+		diff = (ngx_atomic_int_t)(slot->seq - (pos + 1));
+		if (diff == 0) {
+			if (ngx_atomic_cmp_set(&q->head, pos, pos + 1)) {
+				task = slot->task;
+				ngx_memory_barrier();
+				slot->seq = pos + mask + 1;
+				return task;
+			}
+		} else if (diff < 0) {
+			return NULL;  /* empty */
+		}
+		/* lost the race for the position; retry */
+	}
+}
+
+static ngx_thread_task_t *lws_take_task (lws_executor_t *ex, ngx_uint_t index) {
+	ngx_uint_t          i;
+	ngx_thread_task_t  *task;
+
+	/* own queue first, then steal from the others */
+	for (i = 0; i < ex->threads_n; i++) {
+		task = lws_pop_queue(&ex->threads[(index + i) % ex->threads_n].queue, ex->queue_mask);
+		if (task) {
+			(void)ngx_atomic_fetch_add(&ex->pending, -1);
+			return task;
+		}
+	}
+	return NULL;
+}
+
+static void lws_complete_task (lws_executor_t *ex, ngx_thread_task_t *task) {
+	ngx_uint_t  notify;
+
+	/* add to done tasks */
+	task->next = NULL;
+	if (ngx_thread_mutex_lock(&ex->done_mutex, ex->log) != NGX_OK) {
+		return;
+	}
+	notify = ex->done_first == NULL;
+	*ex->done_last = task;
+	ex->done_last = &task->next;
+	(void)ngx_thread_mutex_unlock(&ex->done_mutex, ex->log);
+
+	/* notify the event loop; a full pipe has a notification pending */
+	if (notify && write(ex->notify[1], "", 1) == -1 && ngx_errno != NGX_EAGAIN) {
+		ngx_log_error(NGX_LOG_ALERT, ex->log, ngx_errno, "[LWS] failed to notify executor");
+	}
+}
+
+static void *lws_executor_thread (void *data) {
+	sigset_t                set;
+	lws_executor_t         *ex;
+	ngx_thread_task_t      *task;
+	lws_executor_thread_t  *th;
+
+	/* block signals, as in NGINX thread pools */
+	sigfillset(&set);
+	sigdelset(&set, SIGILL);
+	sigdelset(&set, SIGFPE);
+	sigdelset(&set, SIGSEGV);
+	sigdelset(&set, SIGBUS);
+	(void)pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	th = data;
+	ex = th->ex;
+	for ( ;; ) {
+		/* run a task */
+		task = lws_take_task(ex, th->index);
+		if (task) {
+			task->id = th->index + 1;  /* reports the thread for affinity */
+			task->handler(task->ctx, ex->log);
+			lws_complete_task(ex, task);
+			continue;
+		}
+
+		/* wait for tasks */
+		if (ngx_thread_mutex_lock(&ex->mutex, ex->log) != NGX_OK) {
+			break;
+		}
+		(void)ngx_atomic_fetch_add(&ex->idle, 1);
+		while (ex->pending == 0 && !ex->exiting) {
+			if (ngx_thread_cond_wait(&ex->cond, &ex->mutex, ex->log) != NGX_OK) {
+				break;
+			}
+		}
+		(void)ngx_atomic_fetch_add(&ex->idle, -1);
+		(void)ngx_thread_mutex_unlock(&ex->mutex, ex->log);
+		if (ex->exiting) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void lws_executor_handler (ngx_event_t *ev) {
+	u_char              buf[64];
+	ssize_t             n;
+	lws_executor_t     *ex;
+	ngx_connection_t   *c;
+	ngx_thread_task_t  *task, *next;
+
+	/* drain notifications */
+	c = ev->data;
+	ex = c->data;
+	do {
+		n = read(c->fd, buf, sizeof(buf));
+	} while (n == (ssize_t)sizeof(buf));
+
+	/* take done tasks */
+	if (ngx_thread_mutex_lock(&ex->done_mutex, ex->log) != NGX_OK) {
+		return;
+	}
+	task = ex->done_first;
+	ex->done_first = NULL;
+	ex->done_last = &ex->done_first;
+	(void)ngx_thread_mutex_unlock(&ex->done_mutex, ex->log);
+
+	/* complete */
+	while (task) {
+		next = task->next;
+		task->event.complete = 1;
+		task->event.active = 0;
+		task->event.handler(&task->event);
+		task = next;
+	}
+
+	if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+		ngx_log_error(NGX_LOG_ALERT, ex->log, 0, "[LWS] failed to handle executor event");
+	}
+}
+
+lws_executor_t *lws_create_executor (ngx_uint_t threads_n, ngx_uint_t queue_max, ngx_flag_t pin,
+		ngx_log_t *log) {
+	int                     err;
+	ngx_uint_t              i, j, size;
+	lws_executor_t         *ex;
+	lws_executor_thread_t  *th;
+#if (NGX_HAVE_SCHED_SETAFFINITY)
+	cpu_set_t               cpuset;
+#endif
+
+	/* allocate */
+	ex = ngx_calloc(sizeof(lws_executor_t) + threads_n * sizeof(lws_executor_thread_t), log);
+	if (!ex) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate executor");
+		return NULL;
+	}
+	ex->log = log;
+	ex->threads_n = threads_n;
+	ex->threads = (lws_executor_thread_t *)(ex + 1);
+	ex->done_last = &ex->done_first;
+	ex->notify[0] = ex->notify[1] = -1;
+	for (size = 1; size < queue_max; size <<= 1) { /* void */ }
+	ex->queue_mask = size - 1;
+	for (i = 0; i < threads_n; i++) {
+		th = &ex->threads[i];
+		th->ex = ex;
+		th->index = i;
+		th->queue.slots = ngx_alloc(size * sizeof(lws_executor_slot_t), log);
+		if (!th->queue.slots) {
+			ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate executor queue");
+			goto error;
+		}
+		for (j = 0; j < size; j++) {
+			th->queue.slots[j].seq = j;
+			th->queue.slots[j].task = NULL;
+		}
+	}
+
+	/* synchronization */
+	if (ngx_thread_mutex_create(&ex->mutex, log) != NGX_OK) {
+		goto error;
+	}
+	if (ngx_thread_cond_create(&ex->cond, log) != NGX_OK) {
+		(void)ngx_thread_mutex_destroy(&ex->mutex, log);
+		goto error;
+	}
+	if (ngx_thread_mutex_create(&ex->done_mutex, log) != NGX_OK) {
+		(void)ngx_thread_cond_destroy(&ex->cond, log);
+		(void)ngx_thread_mutex_destroy(&ex->mutex, log);
+		goto error;
+	}
+
+	/* notification pipe */
+	if (pipe(ex->notify) != 0) {
+		ngx_log_error(NGX_LOG_CRIT, log, ngx_errno, "[LWS] failed to create executor pipe");
+		ex->notify[0] = ex->notify[1] = -1;
+		goto error_sync;
+	}
+	if (ngx_nonblocking(ex->notify[0]) == -1 || ngx_nonblocking(ex->notify[1]) == -1) {
+		ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+				"[LWS] failed to make executor pipe nonblocking");
+		goto error_sync;
+	}
+	ex->notify_conn = ngx_get_connection(ex->notify[0], log);
+	if (!ex->notify_conn) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to get executor connection");
+		goto error_sync;
+	}
+	ex->notify_conn->data = ex;
+	ex->notify_conn->read->log = log;
+	ex->notify_conn->read->handler = lws_executor_handler;
+	if (ngx_handle_read_event(ex->notify_conn->read, 0) != NGX_OK) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to add executor event");
+		goto error_sync;
+	}
+
+	/* start threads */
+	for (i = 0; i < threads_n; i++) {
+		th = &ex->threads[i];
+		err = pthread_create(&th->tid, NULL, lws_executor_thread, th);
+		if (err) {
+			ngx_log_error(NGX_LOG_ALERT, log, err, "[LWS] failed to create executor thread");
+			lws_destroy_executor(ex);
+			return NULL;
+		}
+		ex->started_n++;
+		if (pin) {
+#if (NGX_HAVE_SCHED_SETAFFINITY)
+			CPU_ZERO(&cpuset);
+			CPU_SET((ngx_worker * threads_n + i) % ngx_ncpu, &cpuset);
+			err = pthread_setaffinity_np(th->tid, sizeof(cpu_set_t), &cpuset);
+			if (err) {
+				ngx_log_error(NGX_LOG_WARN, log, err, "[LWS] failed to pin executor thread");
+			}
+#else
+			ngx_log_error(NGX_LOG_WARN, log, 0, "[LWS] executor thread pinning not supported");
+			pin = 0;
+#endif
+		}
+	}
+
+	ngx_log_error(NGX_LOG_INFO, log, 0, "[LWS] executor started threads:%ui queue:%ui",
+			threads_n, size);
+	return ex;
+
+	error_sync:
+	(void)ngx_thread_mutex_destroy(&ex->done_mutex, log);
+	(void)ngx_thread_cond_destroy(&ex->cond, log);
+	(void)ngx_thread_mutex_destroy(&ex->mutex, log);
+	if (ex->notify_conn) {
+		ngx_close_connection(ex->notify_conn);  /* closes the file descriptor */
+	} else if (ex->notify[0] != -1) {
+		close(ex->notify[0]);
+	}
+	if (ex->notify[1] != -1) {
+		close(ex->notify[1]);
+	}
+
+	error:
+	for (i = 0; i < threads_n; i++) {
+		ngx_free(ex->threads[i].queue.slots);
+	}
+	ngx_free(ex);
+	return NULL;
+}
+
+void lws_destroy_executor (lws_executor_t *ex) {
+	ngx_uint_t  i;
+
+	/* stop threads; tasks not yet taken are abandoned */
+	if (ngx_thread_mutex_lock(&ex->mutex, ex->log) == NGX_OK) {
+		ex->exiting = 1;
+		for (i = 0; i < ex->started_n; i++) {
+			(void)ngx_thread_cond_signal(&ex->cond, ex->log);
+		}
+		(void)ngx_thread_mutex_unlock(&ex->mutex, ex->log);
+	}
+	for (i = 0; i < ex->started_n; i++) {
+		(void)pthread_join(ex->threads[i].tid, NULL);
+	}
+
+	/* free */
+	ngx_close_connection(ex->notify_conn);  /* closes the file descriptor */
+	close(ex->notify[1]);
+	(void)ngx_thread_mutex_destroy(&ex->done_mutex, ex->log);
+	(void)ngx_thread_cond_destroy(&ex->cond, ex->log);
+	(void)ngx_thread_mutex_destroy(&ex->mutex, ex->log);
+	for (i = 0; i < ex->threads_n; i++) {
+		ngx_free(ex->threads[i].queue.slots);
+	}
+	ngx_free(ex);
+}
+
+ngx_uint_t lws_executor_available (lws_executor_t *ex) {
+	ngx_uint_t             i;
+	lws_executor_queue_t  *q;
+
+	/* the event loop is the only producer, so a free slot remains free until it posts */
+	for (i = 0; i < ex->threads_n; i++) {
+		q = &ex->threads[i].queue;
+		if (q->slots[q->tail & ex->queue_mask].seq == q->tail) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+ngx_int_t lws_post_executor (lws_executor_t *ex, ngx_thread_task_t *task) {
+	ngx_uint_t  i, start;
+
+	if (task->event.active) {
+		ngx_log_error(NGX_LOG_ALERT, ex->log, 0, "[LWS] executor task already active");
+		return NGX_ERROR;
+	}
+
+	/* prefer the thread that last ran the task's state, as given by the task ID */
+	if (task->id > 0 && task->id <= ex->threads_n) {
+		start = task->id - 1;
+	} else {
+		start = ex->next;
+		ex->next = (ex->next + 1) % ex->threads_n;
+	}
+	task->event.active = 1;
+	for (i = 0; i < ex->threads_n; i++) {
+		if (lws_push_queue(&ex->threads[(start + i) % ex->threads_n].queue, ex->queue_mask,
+				task) == NGX_OK) {
+			break;
+		}
+	}
+	if (i == ex->threads_n) {
+		task->event.active = 0;
+		return NGX_AGAIN;
+	}
+
+	/* wake an idle thread */
+	(void)ngx_atomic_fetch_add(&ex->pending, 1);
+	if (ex->idle) {
+		if (ngx_thread_mutex_lock(&ex->mutex, ex->log) == NGX_OK) {
+			(void)ngx_thread_cond_signal(&ex->cond, ex->log);
+			(void)ngx_thread_mutex_unlock(&ex->mutex, ex->log);
+		}
+	}
+	return NGX_OK;
+}
+
+ngx_int_t lws_post_task (lws_main_conf_t *lmcf, ngx_thread_task_t *task) {
+	if (lmcf->executor) {
+		return lws_post_executor(lmcf->executor, task);
+	}
+	return ngx_thread_task_post(lmcf->thread_pool, task);
+}
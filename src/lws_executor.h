@@ -0,0 +1,34 @@
+/*
+ * LWS executor
+ *
+ * Copyright (C) 2026 Andre Naef
+ */
+
+
+#ifndef _LWS_EXECUTOR_INCLUDED
+#define _LWS_EXECUTOR_INCLUDED
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_thread_pool.h>
+
+
+#define LWS_EXECUTOR_QUEUE_MAX_DEFAULT  64
+
+
+typedef struct lws_executor_s lws_executor_t;
+
+
+#include <lws_module.h>
+
+
+lws_executor_t *lws_create_executor(ngx_uint_t threads_n, ngx_uint_t queue_max, ngx_flag_t pin,
+		ngx_log_t *log);
+void lws_destroy_executor(lws_executor_t *ex);
+ngx_uint_t lws_executor_available(lws_executor_t *ex);
+ngx_int_t lws_post_executor(lws_executor_t *ex, ngx_thread_task_t *task);
+ngx_int_t lws_post_task(lws_main_conf_t *lmcf, ngx_thread_task_t *task);
+
+
+#endif /* _LWS_EXECUTOR_INCLUDED */
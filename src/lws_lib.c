@@ -29,6 +29,19 @@ typedef struct {
 } luaL_Stream;
 #endif
 
+typedef struct {
+	lws_file_version_t   version;  /* version of the file */
+	size_t               len;      /* length of bytecode */
+	u_char              *data;     /* bytecode */
+} lws_chunk_t;
+
+typedef struct {
+	u_char     *data;   /* data */
+	size_t      len;    /* length */
+	size_t      alloc;  /* allocated */
+	ngx_log_t  *log;    /* log */
+} lws_chunk_buf_t;
+
 
 /* compatibility */
 static inline int lws_getfield(lua_State *L, int index, const char *key);
@@ -50,6 +63,7 @@ static int lws_lua_request_ctx_tostring(lua_State *L);
 
 /* table */
 static lws_lua_table_t *lws_create_lua_table(lua_State *L);
+static lws_table_t *lws_lua_table_load(lua_State *L, lws_lua_table_t *lt);
 static int lws_lua_table_index(lua_State *L);
 static int lws_lua_table_newindex(lua_State *L);
 static int lws_lua_table_next(lua_State *L);
@@ -71,12 +85,16 @@ static int lws_lua_strict_index(lua_State *L);
 static luaL_Stream *lws_create_file(lua_State *L);
 static int lws_close_file(lua_State *L);
 static int lws_file_flush_hook(lua_State *L);
+static int lws_write_stream(lws_request_ctx_t *ctx, u_char *data, size_t size);
 static int lws_hook_file(lua_State *L);
 
 /* functions */
 static int lws_log(lua_State *L);
 static int lws_getvariable(lua_State *L);
+static int lws_getbody(lua_State *L);
+static int lws_push_mapped_body(lua_State *L);
 static int lws_redirect(lua_State *L);
+static int lws_sendfile(lua_State *L);
 static int lws_setcomplete(lua_State *L);
 static int lws_setclose(lua_State *L);
 static int lws_parseargs(lua_State *L);
@@ -84,8 +102,14 @@ static int lws_parseargs(lua_State *L);
 static int lws_pairs(lua_State *L);
 #endif
 
+/* chunk cache */
+static int lws_chunk_writer(lua_State *L, const void *p, size_t sz, void *ud);
+static const char *lws_chunk_reader(lua_State *L, void *ud, size_t *size);
+
 /* run */
 static void lws_push_env(lws_lua_request_ctx_t *lctx);
+static int lws_is_chunk_version(lua_State *L, ngx_str_t *filename, lws_file_version_t *version);
+static void lws_set_chunk_version(lua_State *L, ngx_str_t *filename, lws_file_version_t *version);
 static int lws_call(lws_lua_request_ctx_t *lctx, ngx_str_t *filename, lws_lua_chunk_e chunk);
 static void lws_clear_env(lua_State *L, ngx_str_t *filename);
 
@@ -163,7 +187,7 @@ void *lws_testudata (lua_State *L, int index, const char *name) {
  */
 
 static void lws_strdup (lws_lua_request_ctx_t *lctx, ngx_str_t *dst, ngx_str_t *src) {
-	dst->data = ngx_alloc(src->len, lctx->ctx->r->connection->log);
+	dst->data = ngx_alloc(src->len, lctx->ctx->log);
 	if (!dst->data) {
 		luaL_error(lctx->ctx->state->L, "failed to allocate string");
 	}
@@ -289,13 +313,24 @@ static lws_lua_table_t *lws_create_lua_table (lua_State *L) {
 	return lt;
 }
 
+static lws_table_t *lws_lua_table_load (lua_State *L, lws_lua_table_t *lt) {
+	/* build request headers on first access */
+	if (!lt->t) {
+		if (!lt->lazy->request_headers && lws_load_request_headers(lt->lazy) != 0) {
+			luaL_error(L, "failed to load request headers");
+		}
+		lt->t = lt->lazy->request_headers;
+	}
+	return lt->t;
+}
+
 static int lws_lua_table_index (lua_State *L) {
 	lws_lua_table_t  *lt;
 	ngx_str_t         key, *value;
 
 	lt = luaL_checkudata(L, 1, LWS_TABLE);
 	key.data = (u_char *)luaL_checklstring(L, 2, &key.len);
-	value = lws_table_get(lt->t, &key);
+	value = lws_table_get(lws_lua_table_load(L, lt), &key);
 	if (value) {
 		lua_pushlstring(L, (const char *)value->data, value->len);
 	} else {
@@ -376,7 +411,7 @@ static int lws_lua_table_next (lua_State *L) {
 		prev.data = (u_char *)lua_tolstring(L, 2, &prev.len);
 		key = &prev;
 	}
-	if (lws_table_next(lt->t, key, &key, (void**)&value) != 0) {
+	if (lws_table_next(lws_lua_table_load(L, lt), key, &key, (void**)&value) != 0) {
 		lua_pushnil(L);
 		return 1;
 	}
@@ -438,6 +473,14 @@ static int lws_lua_response_index (lua_State *L) {
 			return 1;
 		}
 		break;
+
+	case 9:
+		if (ngx_strncmp(key.data, "cache_ttl", 9) == 0) {
+			lctx = lws_get_lua_request_ctx(L);
+			lua_pushinteger(L, lctx->ctx->cache_ttl);
+			return 1;
+		}
+		break;
 	}
 	lua_rawget(L, 1);
 	return 1;
@@ -446,6 +489,7 @@ static int lws_lua_response_index (lua_State *L) {
 static int lws_lua_response_newindex (lua_State *L) {
 	int                     status;
 	ngx_str_t               key;
+	lua_Integer             ttl;
 	lws_lua_request_ctx_t  *lctx;
 
 	luaL_checktype(L, 1, LUA_TTABLE);
@@ -462,6 +506,16 @@ static int lws_lua_response_newindex (lua_State *L) {
 			return 0;
 		}
 		break;
+
+	case 9:
+		if (ngx_strncmp(key.data, "cache_ttl", 9) == 0) {
+			ttl = luaL_checkinteger(L, 3);
+			luaL_argcheck(L, ttl >= 0 && ttl <= LWS_CACHE_TTL_MAX, 3, "invalid TTL");
+			lctx = lws_get_lua_request_ctx(L);
+			lctx->ctx->cache_ttl = ttl;
+			return 0;
+		}
+		break;
 	}
 	lua_rawset(L, 1);
 	return 0;
@@ -520,10 +574,11 @@ static int lws_close_file (lua_State *L) {
 }
 
 static int lws_file_flush_hook (lua_State *L) {
-	long                   len;
-	size_t                 size, written;
+	off_t                  offset;
 	ssize_t                n;
+	u_char                 buf[LWS_RESPONSE_CHUNK_SIZE];
 	luaL_Stream            *s;
+	ngx_chain_t            *cl;
 	lws_request_ctx_t      *ctx;
 	lws_lua_request_ctx_t  *lctx;
 
@@ -536,36 +591,45 @@ static int lws_file_flush_hook (lua_State *L) {
 	if (ctx->redirect.len) {
 		return luaL_error(L, "response redirected");
 	}
+	if (ctx->sendfile.len) {
+		return luaL_error(L, "response sent from file");
+	}
 	if (ctx->streaming_pipe[1] == -1) {
 		return luaL_error(L, "response streaming unavailable");
 	}
-	if ((len = ftell(ctx->response_body)) == -1) {
-		return luaL_error(L, "failed to get response body size");
+	if (fflush(ctx->response_body) != 0) {
+		return luaL_error(L, "failed to flush response body");
 	}
-	if (len > SSIZE_MAX) {
-		return luaL_error(L, "response body too large");
+	if (ctx->vary && lws_open_compression_stream(ctx) != 0) {
+		return luaL_error(L, "failed to open compression stream");
 	}
 	lctx->sealed = 1;
 	lctx->response_headers->readonly = 1;
-	if (len > 0) {
-		size = len;
-		if (fflush(ctx->response_body) != 0) {
-			return luaL_error(L, "failed to flush response body");
-		}
-		for (written = 0; written < size; ) {
-			n = write(ctx->streaming_pipe[1], ctx->response_body_str.data + written,
-					size - written);
-			if (n > 0) {
-				written += n;
-				continue;
+	if (ctx->response_file.fd != NGX_INVALID_FILE) {
+		for (offset = 0; offset < (off_t)ctx->response_len; offset += n) {
+			n = pread(ctx->response_file.fd, buf, ngx_min(sizeof(buf),
+					ctx->response_len - (size_t)offset), offset);
+			if (n <= 0) {
+				if (n == -1 && errno == EINTR) {
+					n = 0;
+					continue;
+				}
+				return luaL_error(L, "failed to read response body temp file");
 			}
-			if (n == -1 && errno == EINTR) {
-				continue;
+			if (lws_write_stream(ctx, buf, n) != 0) {
+				return luaL_error(L, "failed to write response");
 			}
+		}
+	}
+	for (cl = ctx->response_cl; cl; cl = cl->next) {
+		if (lws_write_stream(ctx, cl->buf->pos, cl->buf->last - cl->buf->pos) != 0) {
 			return luaL_error(L, "failed to write response");
 		}
-		rewind(ctx->response_body);
 	}
+	if (ctx->compression && lws_write_compression_stream(ctx, NULL, 0, 1) != 0) {
+		return luaL_error(L, "failed to write response");
+	}
+	lws_reset_response_body(ctx);
 	return 0;
 
 	prev:
@@ -575,6 +639,27 @@ static int lws_file_flush_hook (lua_State *L) {
 	return lua_gettop(L);
 }
 
+static int lws_write_stream (lws_request_ctx_t *ctx, u_char *data, size_t size) {
+	size_t   written;
+	ssize_t  n;
+
+	if (ctx->compression) {
+		return lws_write_compression_stream(ctx, data, size, 0);
+	}
+	for (written = 0; written < size; ) {
+		n = write(ctx->streaming_pipe[1], data + written, size - written);
+		if (n > 0) {
+			written += n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		return -1;
+	}
+	return 0;
+}
+
 static int lws_hook_file (lua_State *L) {
 	if (lws_getmetatable(L, LUA_FILEHANDLE) != LUA_TTABLE) {
 		return luaL_error(L, "no file metatable");
@@ -608,10 +693,10 @@ static int lws_log (lua_State *L) {
 	msg.data = (u_char *)luaL_checklstring(L, index, &msg.len);
 	lctx = lws_get_lua_request_ctx(L);
 	if (level != NGX_LOG_DEBUG) {
-		ngx_log_error(level, lctx->ctx->r->connection->log, 0, "[LWS] %V", &msg);
+		ngx_log_error(level, lctx->ctx->log, 0, "[LWS] %V", &msg);
 	} else {
 		level |= NGX_LOG_DEBUG_HTTP;
-		ngx_log_debug(level, lctx->ctx->r->connection->log, 0, "[LWS] %V", &msg);
+		ngx_log_debug(level, lctx->ctx->log, 0, "[LWS] %V", &msg);
 	}
 	return 0;
 }
@@ -622,7 +707,7 @@ static int lws_getvariable (lua_State *L) {
 
 	key.data = (u_char *)luaL_checklstring(L, 1, &key.len);
 	lctx = lws_get_lua_request_ctx(L);
-	value = lws_table_get(lctx->ctx->variables, &key);
+	value = lctx->ctx->variables ? lws_table_get(lctx->ctx->variables, &key) : NULL;
 	if (value) {
 		lua_pushlstring(L, (const char *)value->data, value->len);
 	} else {
@@ -631,6 +716,87 @@ static int lws_getvariable (lua_State *L) {
 	return 1;
 }
 
+static int lws_getbody (lua_State *L) {
+	int                       rc;
+	u_char                   *p;
+	size_t                    len, n;
+	ngx_buf_t                *b;
+	ngx_chain_t              *cl;
+	luaL_Buffer               buffer;
+	lws_request_ctx_t        *ctx;
+	lws_lua_request_ctx_t    *lctx;
+	ngx_http_request_body_t  *rb;
+
+	lctx = lws_get_lua_request_ctx(L);
+	if (lctx->chunk == LWS_LC_INIT) {
+		return luaL_error(L, "not allowed in %s chunk", lws_chunk_names[lctx->chunk]);
+	}
+	ctx = lctx->ctx;
+	rb = ctx->r->request_body;
+
+	/* streaming body: read the remainder from the pipe */
+	if (ctx->request_stream) {
+		luaL_buffinit(L, &buffer);
+		do {
+			p = (u_char *)luaL_prepbuffer(&buffer);
+			n = fread(p, 1, LUAL_BUFFERSIZE, ctx->request_body);
+			luaL_addsize(&buffer, n);
+		} while (n == LUAL_BUFFERSIZE);
+		if (ferror(ctx->request_body)) {
+			return luaL_error(L, "failed to read request body");
+		}
+		luaL_pushresult(&buffer);
+		return 1;
+	}
+
+	/* temp file: copy once from a read-only mapping, bypassing stdio */
+	if (rb && rb->temp_file) {
+		len = (size_t)rb->temp_file->file.offset;
+		if (len == 0) {
+			lua_pushliteral(L, "");
+			return 1;
+		}
+		p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, rb->temp_file->file.fd, 0);
+		if (p == MAP_FAILED) {
+			return luaL_error(L, "failed to map request body");
+		}
+		(void)madvise(p, len, MADV_SEQUENTIAL);
+		lua_pushcfunction(L, lws_push_mapped_body);
+		lua_pushlightuserdata(L, p);
+		lua_pushlightuserdata(L, &len);
+		rc = lua_pcall(L, 2, 1, 0);  /* unmap on memory errors, too */
+		(void)munmap(p, len);
+		if (rc != LUA_OK) {
+			return lua_error(L);
+		}
+		return 1;
+	}
+
+	/* memory: copy once if the body is in a single buffer, else once more via a buffer */
+	cl = rb ? rb->bufs : NULL;
+	if (!cl) {
+		lua_pushliteral(L, "");
+		return 1;
+	}
+	if (!cl->next) {
+		b = cl->buf;
+		lua_pushlstring(L, (const char *)b->pos, b->last - b->pos);
+		return 1;
+	}
+	luaL_buffinit(L, &buffer);
+	for ( ; cl; cl = cl->next) {
+		b = cl->buf;
+		luaL_addlstring(&buffer, (const char *)b->pos, b->last - b->pos);
+	}
+	luaL_pushresult(&buffer);
+	return 1;
+}
+
+static int lws_push_mapped_body (lua_State *L) {
+	lua_pushlstring(L, lua_touserdata(L, 1), *(size_t *)lua_touserdata(L, 2));
+	return 1;
+}
+
 static int lws_redirect (lua_State *L) {
 	ngx_str_t               redirect, args;
 	lws_lua_request_ctx_t  *lctx;
@@ -657,6 +823,35 @@ static int lws_redirect (lua_State *L) {
 	return 0;
 }
 
+static int lws_sendfile (lua_State *L) {
+	ngx_str_t               path;
+	lua_Integer             offset, length;
+	lws_lua_request_ctx_t  *lctx;
+
+	lctx = lws_get_lua_request_ctx(L);
+	if (lctx->chunk != LWS_LC_PRE && lctx->chunk != LWS_LC_MAIN) {
+		return luaL_error(L, "not allowed in %s chunk", lws_chunk_names[lctx->chunk]);
+	}
+	if (lctx->sealed) {
+		return luaL_error(L, "response header sealed");
+	}
+	path.data = (u_char *)luaL_checklstring(L, 1, &path.len);
+	luaL_argcheck(L, path.len > 0, 1, "empty path");
+	offset = luaL_optinteger(L, 2, 0);
+	luaL_argcheck(L, offset >= 0, 2, "negative offset");
+	length = luaL_optinteger(L, 3, -1);
+	luaL_argcheck(L, length >= -1, 3, "negative length");
+	ngx_free(lctx->ctx->sendfile.data);
+	ngx_str_null(&lctx->ctx->sendfile);
+	lws_strdup(lctx, &lctx->ctx->sendfile, &path);
+	lctx->ctx->sendfile_offset = offset;
+	lctx->ctx->sendfile_length = length;
+	if (lctx->chunk == LWS_LC_PRE) {
+		lctx->complete = 1;
+	}
+	return 0;
+}
+
 static int lws_setcomplete (lua_State *L) {
 	lws_lua_request_ctx_t  *lctx;
 
@@ -772,7 +967,9 @@ int lws_open_lws (lua_State *L) {
 	static luaL_Reg     lws_lua_functions[] = {
 		{"log", lws_log},
 		{"getvariable", lws_getvariable},
+		{"getbody", lws_getbody},
 		{"redirect", lws_redirect},
+		{"sendfile", lws_sendfile},
 		{"setcomplete", lws_setcomplete},
 		{"setclose", lws_setclose},
 		{"parseargs", lws_parseargs},
@@ -885,6 +1082,174 @@ int lws_traceback (lua_State *L) {
 }
 
 
+/*
+ * chunk cache
+ */
+
+static int lws_chunk_writer (lua_State *L, const void *p, size_t sz, void *ud) {
+	size_t            alloc;
+	u_char           *data;
+	lws_chunk_buf_t  *buf;
+
+	buf = ud;
+	if (buf->len + sz > buf->alloc) {
+		alloc = buf->alloc ? buf->alloc : 4096;
+		while (alloc < buf->len + sz) {
+			alloc *= 2;
+		}
+		data = realloc(buf->data, alloc);
+		if (!data) {
+			ngx_log_error(NGX_LOG_CRIT, buf->log, 0, "[LWS] failed to allocate chunk buffer");
+			return 1;
+		}
+		buf->data = data;
+		buf->alloc = alloc;
+	}
+	ngx_memcpy(buf->data + buf->len, p, sz);
+	buf->len += sz;
+	return 0;
+}
+
+static const char *lws_chunk_reader (lua_State *L, void *ud, size_t *size) {
+	lws_chunk_t  *chunk;
+
+	chunk = ud;
+	*size = chunk->len;
+	chunk->len = 0;
+	return (const char *)chunk->data;
+}
+
+int lws_load_chunk (lua_State *L, lws_main_conf_t *lmcf, const char *filename) {
+	int                  rc;
+	void                *data;
+	size_t               len;
+	ngx_str_t            key;
+	struct stat          sb;
+	lws_chunk_t         *chunk, reader;
+	lws_chunk_buf_t      buf;
+	lws_file_version_t   version;
+
+	/* check cache */
+	if (!lmcf->chunk_cache || stat(filename, &sb) != 0) {
+		return luaL_loadfilex(L, filename, "bt");
+	}
+	lws_get_file_version(&sb, &version);
+	key.data = (u_char *)filename;
+	key.len = ngx_strlen(filename);
+	lua_pushfstring(L, "@%s", filename);
+	if (ngx_thread_mutex_lock(&lmcf->chunk_cache_mutex, lmcf->chunk_cache->log) != NGX_OK) {
+		lua_pop(L, 1);
+		return luaL_loadfilex(L, filename, "bt");
+	}
+	chunk = lws_table_get(lmcf->chunk_cache, &key);
+	len = chunk && ngx_memcmp(&chunk->version, &version, sizeof(version)) == 0 ? chunk->len : 0;
+	(void)ngx_thread_mutex_unlock(&lmcf->chunk_cache_mutex, lmcf->chunk_cache->log);
+	if (len > 0) {
+		/* copy bytecode; Lua may raise memory errors, so the lock is held only for the copy,
+		   and the entry is checked again as it may have been evicted meanwhile */
+		data = lua_newuserdata(L, len);
+		if (ngx_thread_mutex_lock(&lmcf->chunk_cache_mutex, lmcf->chunk_cache->log)
+				== NGX_OK) {
+			chunk = lws_table_get(lmcf->chunk_cache, &key);
+			if (chunk && ngx_memcmp(&chunk->version, &version, sizeof(version)) == 0
+					&& chunk->len == len) {
+				ngx_memcpy(data, chunk->data, len);
+			} else {
+				len = 0;
+			}
+			(void)ngx_thread_mutex_unlock(&lmcf->chunk_cache_mutex, lmcf->chunk_cache->log);
+		} else {
+			len = 0;
+		}
+		if (len > 0) {
+			/* load bytecode */
+			reader.data = data;
+			reader.len = len;
+#if LUA_VERSION_NUM >= 502
+			rc = lua_load(L, lws_chunk_reader, &reader, lua_tostring(L, -2), "b");
+#else
+			rc = lua_load(L, lws_chunk_reader, &reader, lua_tostring(L, -2));
+#endif
+			lua_remove(L, -2);
+			lua_remove(L, -2);
+			return rc;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	/* load source */
+	rc = luaL_loadfilex(L, filename, "bt");
+	if (rc != LUA_OK) {
+		return rc;
+	}
+
+	/* dump bytecode; debug information is retained for tracebacks */
+	ngx_memzero(&buf, sizeof(buf));
+	buf.log = lmcf->chunk_cache->log;
+#if LUA_VERSION_NUM >= 503
+	rc = lua_dump(L, lws_chunk_writer, &buf, 0);
+#else
+	rc = lua_dump(L, lws_chunk_writer, &buf);
+#endif
+	if (rc != 0) {
+		free(buf.data);
+		return LUA_OK;
+	}
+
+	/* store */
+	chunk = ngx_alloc(sizeof(lws_chunk_t) + buf.len, buf.log);
+	if (!chunk) {
+		free(buf.data);
+		return LUA_OK;
+	}
+	chunk->version = version;
+	chunk->len = buf.len;
+	chunk->data = (u_char *)(chunk + 1);
+	ngx_memcpy(chunk->data, buf.data, buf.len);
+	free(buf.data);
+	if (ngx_thread_mutex_lock(&lmcf->chunk_cache_mutex, buf.log) != NGX_OK) {
+		ngx_free(chunk);
+		return LUA_OK;
+	}
+	if (lws_table_set(lmcf->chunk_cache, &key, chunk) != 0) {
+		ngx_free(chunk);
+	}
+	(void)ngx_thread_mutex_unlock(&lmcf->chunk_cache_mutex, buf.log);
+	return LUA_OK;
+}
+
+#if LUA_VERSION_NUM >= 502
+int lws_search_chunk (lua_State *L) {
+	const char       *name, *filename;
+	lws_main_conf_t  *lmcf;
+
+	/* search path; the package table is the second upvalue */
+	name = luaL_checkstring(L, 1);
+	if (lws_getfield(L, lua_upvalueindex(2), "searchpath") != LUA_TFUNCTION) {
+		return luaL_error(L, "failed to get searchpath");
+	}
+	lua_pushvalue(L, 1);
+	lws_getfield(L, lua_upvalueindex(2), "path");
+	lua_call(L, 2, 2);
+	if (lua_isnil(L, -2)) {
+		return 1;  /* error message */
+	}
+	lua_pop(L, 1);
+	filename = lua_tostring(L, -1);
+
+	/* load */
+	lmcf = lua_touserdata(L, lua_upvalueindex(1));
+	if (lws_load_chunk(L, lmcf, filename) != LUA_OK) {
+		return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s", name,
+				filename, lua_tostring(L, -1));
+	}
+	lua_insert(L, -2);  /* [function, filename] */
+	return 2;
+}
+#endif
+
+
 /*
  * run
  */
@@ -922,8 +1287,8 @@ static void lws_push_env (lws_lua_request_ctx_t *lctx) {
 	lua_pushlstring(L, (const char *)r->args.data, r->args.len);
 	lua_setfield(L, -2, "args");
 	lt = lws_create_lua_table(L);
-	lt->t = ctx->request_headers;
-	lt->readonly = 1;  /* required as key dup and free are not enabled */
+	lt->lazy = ctx;    /* request headers are built on first access */
+	lt->readonly = 1;  /* required as key dup is not enabled */
 	lt->external = 1;  /* will be freed externally */
 	lua_setfield(L, -2, "headers");
 	request_body = lws_create_file(L);
@@ -953,25 +1318,76 @@ static void lws_push_env (lws_lua_request_ctx_t *lctx) {
 	lua_setfield(L, -2, "response");
 }
 
+static int lws_is_chunk_version (lua_State *L, ngx_str_t *filename,
+		lws_file_version_t *version) {
+	int          is;
+	size_t       len;
+	const char  *stored;
+
+	if (lws_getfield(L, LUA_REGISTRYINDEX, LWS_CHUNK_VERSIONS) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	lua_pushlstring(L, (const char *)filename->data, filename->len);
+	lws_rawget(L, -2);
+	stored = lua_tolstring(L, -1, &len);
+	is = stored && len == sizeof(lws_file_version_t)
+			&& ngx_memcmp(stored, version, sizeof(lws_file_version_t)) == 0;
+	lua_pop(L, 2);
+	return is;
+}
+
+static void lws_set_chunk_version (lua_State *L, ngx_str_t *filename,
+		lws_file_version_t *version) {
+	if (lws_getfield(L, LUA_REGISTRYINDEX, LWS_CHUNK_VERSIONS) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LWS_CHUNK_VERSIONS);
+	}
+	lua_pushlstring(L, (const char *)filename->data, filename->len);
+	lua_pushlstring(L, (const char *)version, sizeof(lws_file_version_t));
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
 static int lws_call (lws_lua_request_ctx_t *lctx, ngx_str_t *filename, lws_lua_chunk_e chunk) {
-	int         result, isint;
-	lua_State  *L;
+	int                 result, isint, reload;
+	lua_State          *L;
+	lws_file_version_t  version;
 
 	/* set chunk */
 	lctx->chunk = chunk;
 
+	/* get file version, if reloading changed chunks */
+	ngx_memzero(&version, sizeof(version));
+	reload = lctx->ctx->llcf->reload;
+	if (reload) {
+		(void)lws_get_file_status(lctx->ctx->state->lmcf, filename, &version,
+				lctx->ctx->log);
+	}
+
 	/* get, or load and store, the function */
 	L = lctx->ctx->state->L;
 	lua_pushlstring(L, (const char *)filename->data, filename->len);  /* [filename] */
 	lua_pushvalue(L, -1);  /* [filename, filename] */
-	if (lws_rawget(L, 2) != LUA_TFUNCTION) {  /* [filename, x] */
+	if (lws_rawget(L, 2) != LUA_TFUNCTION || (reload && version.mtime
+			&& !lws_is_chunk_version(L, filename, &version))) {  /* [filename, x] */
+		if (!lua_isnil(L, -1)) {
+			ngx_log_error(NGX_LOG_INFO, lctx->ctx->log, 0,
+					"[LWS] reloading %s chunk filename:%V", lws_chunk_names[chunk],
+					filename);
+		}
 		lua_pop(L, 1);  /* [filename] */
-		if (luaL_loadfilex(L, lua_tostring(L, -1), "bt") != LUA_OK) {
+		if (lws_load_chunk(L, lctx->ctx->state->lmcf, lua_tostring(L, -1)) != LUA_OK) {
 			return lua_error(L);
 		}  /* [filename, function] */
 		lua_pushvalue(L, -2);  /* [filename, function, filename] */
 		lua_pushvalue(L, -2);  /* [filename, function, filename, function] */
 		lua_rawset(L, 2);      /* [filename, function] */
+		if (reload) {
+			lws_set_chunk_version(L, filename, &version);
+		}
 	}  /* [filename, function] */
 
 	/* set _ENV */
@@ -991,7 +1407,7 @@ static int lws_call (lws_lua_request_ctx_t *lctx, ngx_str_t *filename, lws_lua_c
 #endif  /* [filename, function] */
 
 	/* call the function */
-	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, lctx->ctx->r->connection->log, 0,
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, lctx->ctx->log, 0,
 			"[LWS] calling %s chunk filename:%V", lws_chunk_names[chunk],
 			filename);
 	lua_call(L, 0, 1);  /* [filename, result] */
@@ -1002,7 +1418,7 @@ static int lws_call (lws_lua_request_ctx_t *lctx, ngx_str_t *filename, lws_lua_c
 	} else {
 		result = lua_tointegerx(L, -1, &isint);
 		if (!isint) {
-			ngx_log_error(NGX_LOG_WARN, lctx->ctx->r->connection->log, 0,
+			ngx_log_error(NGX_LOG_WARN, lctx->ctx->log, 0,
 					"[LWS] bad result type (nil or integer expected, got %s)",
 					luaL_typename(L, -1));
 			result = -1;
@@ -1076,12 +1492,20 @@ int lws_run (lua_State *L) {
 		ctx->state->init = 1;
 	}
 
+	/* pre-warming? */
+	if (!ctx->r) {
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, LWS_REQUEST_CTX_CURRENT);  /* [ctx, chunks] */
+		lua_pushinteger(L, 0);  /* [ctx, chunks, result] */
+		return 1;
+	}
+
 	/* push environment */
 	lws_push_env(lctx);  /* [ctx, chunks, env] */
 
 	/* pre chunk */
-	if (ctx->state->llcf->pre.len) {
-		result = lws_call(lctx, &ctx->state->llcf->pre, LWS_LC_PRE);
+	if (ctx->llcf->pre.len) {
+		result = lws_call(lctx, &ctx->llcf->pre, LWS_LC_PRE);
 		if (lctx->complete) {
 			goto post;
 		}  /* result is invariably 0 at this point */
@@ -1092,17 +1516,17 @@ int lws_run (lua_State *L) {
 
 	/* post chunk */
 	post:
-	if (ctx->state->llcf->post.len) {
-		(void)lws_call(lctx, &ctx->state->llcf->post, LWS_LC_POST);
+	if (ctx->llcf->post.len) {
+		(void)lws_call(lctx, &ctx->llcf->post, LWS_LC_POST);
 	}
-	if (ctx->state->llcf->pre.len) {
-		lws_clear_env(L, &ctx->state->llcf->pre);
+	if (ctx->llcf->pre.len) {
+		lws_clear_env(L, &ctx->llcf->pre);
 	}
 	if (!lctx->complete) {
 		lws_clear_env(L, &ctx->main);
 	}
-	if (ctx->state->llcf->post.len) {
-		lws_clear_env(L, &ctx->state->llcf->post);
+	if (ctx->llcf->post.len) {
+		lws_clear_env(L, &ctx->llcf->post);
 	}
 
 	/* stop profiler */
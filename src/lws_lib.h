@@ -20,6 +20,7 @@
 #define LWS_TABLE                "lws.table"                /* table metatable */
 #define LWS_RESPONSE             "lws.response"             /* response metatable */
 #define LWS_CHUNKS               "lws.chunks"               /* loaded chunks */
+#define LWS_CHUNK_VERSIONS       "lws.chunk_versions"       /* loaded chunk file versions */
 #define LWS_FILE                 "lws.file"                 /* file environment (Lua 5.1) */
 
 
@@ -42,9 +43,10 @@ struct lws_lua_request_ctx_s {
 };
 
 struct lws_lua_table_s {
-	lws_table_t  *t;           /* table */
-	unsigned      readonly:1;  /* read-only access */
-	unsigned      external:1;  /* managed externally */
+	lws_table_t        *t;           /* table; NULL until loaded if lazy */
+	lws_request_ctx_t  *lazy;        /* request context to load request headers from */
+	unsigned            readonly:1;  /* read-only access */
+	unsigned            external:1;  /* managed externally */
 };
 
 
@@ -54,6 +56,10 @@ void *lws_testudata(lua_State *L, int index, const char *name);
 void lws_get_msg(lua_State *L, int index, ngx_str_t *msg);
 int lws_traceback(lua_State *L);
 int lws_open_lws(lua_State *L);
+int lws_load_chunk(lua_State *L, lws_main_conf_t *lmcf, const char *filename);
+#if LUA_VERSION_NUM >= 502
+int lws_search_chunk(lua_State *L);
+#endif
 int lws_run(lua_State *L);
 
 
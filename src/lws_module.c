@@ -13,30 +13,64 @@
 #define LWS_STREAMING_READS_MAX  16
 
 
+typedef struct {
+	lws_file_status_e   fs;       /* file status */
+	lws_file_version_t  version;  /* file version */
+} lws_file_stat_t;
+
+
+static ngx_int_t lws_postconfiguration(ngx_conf_t *cf);
 static void *lws_create_main_conf(ngx_conf_t *cf);
 static char *lws_init_main_conf(ngx_conf_t *cf, void *main);
 static void lws_cleanup_main_conf(void *data);
 static char *lws_stat_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *lws_executor(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static void *lws_create_loc_conf(ngx_conf_t *cf);
 static char *lws_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
 static void lws_cleanup_loc_conf(void *data);
 static char *lws(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *lws_max_states(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *lws_codel(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *lws_variable(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *lws_error_response(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static ngx_int_t lws_init_process(ngx_cycle_t *cycle);
+static void lws_exit_process(ngx_cycle_t *cycle);
+static void lws_warm_thread_handler(void *data, ngx_log_t *log);
+static void lws_warm_finalization_handler(ngx_event_t *ev);
 
-static lws_file_status_e lws_get_file_status(ngx_http_request_t *t, ngx_str_t *filename);
 static ngx_int_t lws_handler(ngx_http_request_t *r);
 static void lws_body_handler(ngx_http_request_t *r);
+static ngx_int_t lws_can_run(lws_main_conf_t *lmcf, lws_loc_conf_t *llcf);
+static void lws_adapt_states(lws_loc_conf_t *llcf, ngx_uint_t latency);
+static void lws_trigger_queues(lws_main_conf_t *lmcf, lws_loc_conf_t *llcf);
+static void lws_queue_request(lws_main_conf_t *lmcf, lws_loc_conf_t *llcf,
+		lws_request_ctx_t *ctx);
+static void lws_dequeue_request(lws_main_conf_t *lmcf, lws_loc_conf_t *llcf,
+		lws_request_ctx_t *ctx);
+static void lws_cleanup_queued_request(void *data);
+static ngx_uint_t lws_codel_shed(lws_loc_conf_t *llcf, ngx_msec_t sojourn, ngx_msec_t now);
+static ngx_msec_t lws_codel_control(lws_loc_conf_t *llcf, ngx_msec_t t);
+static ngx_int_t lws_retry_after(ngx_http_request_t *r);
+static void lws_shed_request(ngx_http_request_t *r);
 static void lws_queue_handler(ngx_event_t *ev);
+static void lws_deadline_handler(ngx_event_t *ev);
+static ngx_int_t lws_prepare_request(lws_request_ctx_t *ctx);
 static void lws_state_handler(lws_request_ctx_t *ctx);
 static void lws_thread_handler(void *data, ngx_log_t *log);
 static ssize_t lws_read_handler(void *cookie, char *buf, size_t size);
+static ssize_t lws_stream_read_handler(void *cookie, char *buf, size_t size);
+static int lws_stream_close_handler(void *cookie);
+static ssize_t lws_write_handler(void *cookie, const char *buf, size_t size);
+static int lws_spill_response_body(lws_request_ctx_t *ctx);
+static ngx_int_t lws_open_request_stream(lws_request_ctx_t *ctx);
+static ngx_int_t lws_pump_request_body(lws_request_ctx_t *ctx);
+static void lws_request_stream_handler(ngx_http_request_t *r);
+static void lws_request_stream_write_handler(ngx_event_t *ev);
 static void lws_stream_handler(ngx_event_t *ev);
 static void lws_stream_write_handler(ngx_http_request_t *r);
 static void lws_finalization_handler(ngx_event_t *ev);
 static ngx_int_t lws_set_response_header(lws_request_ctx_t *ctx);
+static void lws_send_file(lws_request_ctx_t *ctx);
 static void lws_send_error_response(lws_request_ctx_t *ctx, ngx_int_t rc);
 static void lws_send_json_error_response(lws_request_ctx_t *ctx, ngx_int_t rc);
 static void lws_send_html_error_response(lws_request_ctx_t *ctx, ngx_int_t rc);
@@ -50,6 +84,20 @@ static cookie_io_functions_t lws_request_read_functions = {
 	NULL               /* close */
 };
 
+static cookie_io_functions_t lws_request_stream_functions = {
+	lws_stream_read_handler,   /* read */
+	NULL,                      /* write */
+	NULL,                      /* seek */
+	lws_stream_close_handler   /* close */
+};
+
+static cookie_io_functions_t lws_response_write_functions = {
+	NULL,               /* read */
+	lws_write_handler,  /* write */
+	NULL,               /* seek */
+	NULL                /* close */
+};
+
 static ngx_conf_enum_t lws_error_responses[] = {
 	{ngx_string("json"), LWS_ER_JSON},
 	{ngx_string("html"), LWS_ER_HTML},
@@ -73,6 +121,22 @@ static ngx_command_t lws_commands[] = {
 		offsetof(lws_main_conf_t, stat_cache_cap),
 		NULL
 	},
+	{
+		ngx_string("lws_executor"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE123,
+		lws_executor,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		offsetof(lws_main_conf_t, executor_threads),
+		NULL
+	},
+	{
+		ngx_string("lws_chunk_cache"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_size_slot,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		offsetof(lws_main_conf_t, chunk_cache_cap),
+		NULL
+	},
 	{
 		ngx_string("lws"),
 		NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
@@ -121,6 +185,30 @@ static ngx_command_t lws_commands[] = {
 		offsetof(lws_loc_conf_t, cpath),
 		NULL
 	},
+	{
+		ngx_string("lws_state_pool"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_str_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, pool_name),
+		NULL
+	},
+	{
+		ngx_string("lws_min_states"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_size_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, states_min),
+		NULL
+	},
+	{
+		ngx_string("lws_reload"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, reload),
+		NULL
+	},
 	{
 		ngx_string("lws_max_states"),
 		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
@@ -129,6 +217,30 @@ static ngx_command_t lws_commands[] = {
 		offsetof(lws_loc_conf_t, states_max),
 		NULL
 	},
+	{
+		ngx_string("lws_adaptive_states"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, states_adaptive),
+		NULL
+	},
+	{
+		ngx_string("lws_max_wait"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_msec_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, requests_wait_max),
+		NULL
+	},
+	{
+		ngx_string("lws_codel"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+		lws_codel,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, codel_target),
+		NULL
+	},
 	{
 		ngx_string("lws_max_memory"),
 		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
@@ -169,6 +281,22 @@ static ngx_command_t lws_commands[] = {
 		offsetof(lws_loc_conf_t, state_timeout),
 		NULL
 	},
+	{
+		ngx_string("lws_jitter"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_num_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, state_jitter),
+		NULL
+	},
+	{
+		ngx_string("lws_replace"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_msec_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, state_replace),
+		NULL
+	},
 	{
 		ngx_string("lws_variable"),
 		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
@@ -193,6 +321,62 @@ static ngx_command_t lws_commands[] = {
 		offsetof(lws_loc_conf_t, streaming),
 		NULL
 	},
+	{
+		ngx_string("lws_request_streaming"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, request_streaming),
+		NULL
+	},
+	{
+		ngx_string("lws_response_buffer"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_size_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, response_buffer),
+		NULL
+	},
+	{
+		ngx_string("lws_compress"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, compress),
+		NULL
+	},
+	{
+		ngx_string("lws_compress_level"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_num_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, compress_level),
+		NULL
+	},
+	{
+		ngx_string("lws_cache_zone"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE2,
+		lws_cache_zone,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("lws_cache"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+		lws_cache,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("lws_coalesce"),
+		NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_http_set_complex_value_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(lws_loc_conf_t, coalesce_key),
+		NULL
+	},
 	{
 		ngx_string("lws_monitor"),
 		NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
@@ -206,7 +390,7 @@ static ngx_command_t lws_commands[] = {
 
 static ngx_http_module_t lws_ctx = {
 	NULL,                  /* preconfiguration */
-	NULL,                  /* postconfiguration */
+	lws_postconfiguration, /* postconfiguration */
 	lws_create_main_conf , /* create main configuration */
 	lws_init_main_conf,    /* init main configuration */
 	NULL,                  /* create server configuration */
@@ -225,7 +409,7 @@ ngx_module_t lws_module = {
 	lws_init_process,      /* init process */
 	NULL,                  /* init thread */
 	NULL,                  /* exit thread */
-	NULL,                  /* exit process */
+	lws_exit_process,      /* exit process */
 	NULL,                  /* exit master */
 	NGX_MODULE_V1_PADDING
 };
@@ -235,6 +419,48 @@ ngx_module_t lws_module = {
  * configuration
  */
 
+static ngx_int_t lws_postconfiguration (ngx_conf_t *cf) {
+	ngx_uint_t        i, j;
+	lws_loc_conf_t  **llcfp, *llcf, *owner;
+	lws_main_conf_t  *lmcf;
+
+	/* resolve shared Lua state pools; the first location referring to a pool owns it */
+	lmcf = ngx_http_conf_get_module_main_conf(cf, lws_module);
+	llcfp = lmcf->locations.elts;
+	for (i = 0; i < lmcf->locations.nelts; i++) {
+		llcf = llcfp[i];
+		if (!llcf->pool_name.len) {
+			continue;
+		}
+		owner = NULL;
+		for (j = 0; j < i; j++) {
+			if (llcfp[j]->pool == llcfp[j] && llcfp[j]->pool_name.len == llcf->pool_name.len
+					&& ngx_strncmp(llcfp[j]->pool_name.data, llcf->pool_name.data,
+					llcf->pool_name.len) == 0) {
+				owner = llcfp[j];
+				break;
+			}
+		}
+		if (!owner) {
+			continue;
+		}
+
+		/* Lua states must be interchangeable */
+		if (llcf->init.len != owner->init.len
+				|| ngx_strncmp(llcf->init.data, owner->init.data, llcf->init.len) != 0
+				|| llcf->path.len != owner->path.len
+				|| ngx_strncmp(llcf->path.data, owner->path.data, llcf->path.len) != 0
+				|| llcf->cpath.len != owner->cpath.len
+				|| ngx_strncmp(llcf->cpath.data, owner->cpath.data, llcf->cpath.len) != 0) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "lws_state_pool \"%V\" requires identical "
+					"lws_init, lws_path, and lws_cpath", &llcf->pool_name);
+			return NGX_ERROR;
+		}
+		llcf->pool = owner;
+	}
+	return NGX_OK;
+}
+
 static void *lws_create_main_conf (ngx_conf_t *cf) {
 	lws_main_conf_t     *lmcf;
 	ngx_pool_cleanup_t  *cln;
@@ -246,6 +472,11 @@ static void *lws_create_main_conf (ngx_conf_t *cf) {
 	}
 	lmcf->stat_cache_cap = NGX_CONF_UNSET_SIZE;
 	lmcf->stat_cache_timeout = NGX_CONF_UNSET;
+	lmcf->chunk_cache_cap = NGX_CONF_UNSET_SIZE;
+	lmcf->executor_threads = NGX_CONF_UNSET_UINT;
+	if (ngx_array_init(&lmcf->locations, cf->pool, 4, sizeof(lws_loc_conf_t *)) != NGX_OK) {
+		return NULL;
+	}
 
 	/* add cleanup */
 	cln = ngx_pool_cleanup_add(cf->pool, 0);
@@ -271,6 +502,9 @@ static char *lws_init_main_conf (ngx_conf_t *cf, void *conf) {
 		return NGX_CONF_ERROR;
 	}
 
+	/* executor */
+	ngx_conf_init_uint_value(lmcf->executor_threads, 0);
+
 	/* stat cache */
 	ngx_conf_init_size_value(lmcf->stat_cache_cap, LWS_STAT_CACHE_CAP_DEFAULT);
 	ngx_conf_init_value(lmcf->stat_cache_timeout, LWS_STAT_CACHE_TIMEOUT_DEFAULT);
@@ -280,8 +514,31 @@ static char *lws_init_main_conf (ngx_conf_t *cf, void *conf) {
 			return NGX_CONF_ERROR;
 		}
 		lws_table_set_dup(lmcf->stat_cache, 1);
+		lws_table_set_free(lmcf->stat_cache, 1);
 		lws_table_set_cap(lmcf->stat_cache, lmcf->stat_cache_cap);
 		lws_table_set_timeout(lmcf->stat_cache, lmcf->stat_cache_timeout);
+		if (ngx_thread_mutex_create(&lmcf->stat_cache_mutex, cf->log) != NGX_OK) {
+			lws_table_free(lmcf->stat_cache);
+			lmcf->stat_cache = NULL;
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	/* chunk cache */
+	ngx_conf_init_size_value(lmcf->chunk_cache_cap, LWS_CHUNK_CACHE_CAP_DEFAULT);
+	if (lmcf->chunk_cache_cap) {
+		lmcf->chunk_cache = lws_table_create(32, &cf->cycle->new_log);
+		if (!lmcf->chunk_cache) {
+			return NGX_CONF_ERROR;
+		}
+		lws_table_set_dup(lmcf->chunk_cache, 1);
+		lws_table_set_free(lmcf->chunk_cache, 1);
+		lws_table_set_cap(lmcf->chunk_cache, lmcf->chunk_cache_cap);
+		if (ngx_thread_mutex_create(&lmcf->chunk_cache_mutex, cf->log) != NGX_OK) {
+			lws_table_free(lmcf->chunk_cache);
+			lmcf->chunk_cache = NULL;
+			return NGX_CONF_ERROR;
+		}
 	}
 
 	return NGX_CONF_OK;
@@ -293,6 +550,11 @@ static void lws_cleanup_main_conf (void *data) {
 	lmcf = data;
 	if (lmcf->stat_cache) {
 		lws_table_free(lmcf->stat_cache);
+		(void)ngx_thread_mutex_destroy(&lmcf->stat_cache_mutex, ngx_cycle->log);
+	}
+	if (lmcf->chunk_cache) {
+		lws_table_free(lmcf->chunk_cache);
+		(void)ngx_thread_mutex_destroy(&lmcf->chunk_cache_mutex, ngx_cycle->log);
 	}
 }
 
@@ -316,6 +578,40 @@ static char *lws_stat_cache (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
 	return NGX_CONF_OK;
 }
 
+static char *lws_executor (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_int_t         n;
+	ngx_str_t        *values;
+	ngx_uint_t        i;
+	lws_main_conf_t  *lmcf;
+
+	lmcf = conf;
+	values = cf->args->elts;
+	if (lmcf->executor_threads != NGX_CONF_UNSET_UINT) {
+		return "is duplicate";
+	}
+	n = ngx_atoi(values[1].data, values[1].len);
+	if (n == NGX_ERROR || n == 0) {
+		return "has invalid threads value";
+	}
+	lmcf->executor_threads = n;
+	lmcf->executor_queue_max = LWS_EXECUTOR_QUEUE_MAX_DEFAULT;
+	for (i = 2; i < cf->args->nelts; i++) {
+		if (values[i].len == 3 && ngx_strncmp(values[i].data, "pin", 3) == 0) {
+			lmcf->executor_pin = 1;
+			continue;
+		}
+		if (i > 2) {
+			return "has invalid parameter";
+		}
+		n = ngx_atoi(values[i].data, values[i].len);
+		if (n == NGX_ERROR || n == 0) {
+			return "has invalid max_queue value";
+		}
+		lmcf->executor_queue_max = n;
+	}
+	return NGX_CONF_OK;
+}
+
 static void *lws_create_loc_conf (ngx_conf_t *cf) {
 	lws_loc_conf_t      *llcf;
 	ngx_pool_cleanup_t  *cln;
@@ -325,24 +621,43 @@ static void *lws_create_loc_conf (ngx_conf_t *cf) {
 	if (!llcf) {
 		return NULL;
 	}
+	llcf->states_min = NGX_CONF_UNSET_SIZE;
 	llcf->states_max = NGX_CONF_UNSET_SIZE;
+	llcf->states_adaptive = NGX_CONF_UNSET;
 	llcf->requests_max = NGX_CONF_UNSET_SIZE;
+	llcf->requests_wait_max = NGX_CONF_UNSET_MSEC;
+	llcf->codel_target = NGX_CONF_UNSET_MSEC;
+	llcf->codel_interval = NGX_CONF_UNSET_MSEC;
 	llcf->state_memory_max = NGX_CONF_UNSET_SIZE;
 	llcf->state_gc = NGX_CONF_UNSET_SIZE;
 	llcf->state_requests_max = NGX_CONF_UNSET;
 	llcf->state_time_max = NGX_CONF_UNSET_MSEC;
 	llcf->state_timeout = NGX_CONF_UNSET_MSEC;
+	llcf->state_jitter = NGX_CONF_UNSET;
+	llcf->state_replace = NGX_CONF_UNSET_MSEC;
 	llcf->error_response = NGX_CONF_UNSET_UINT;
 	llcf->diagnostic = NGX_CONF_UNSET;
 	llcf->streaming = NGX_CONF_UNSET;
+	llcf->request_streaming = NGX_CONF_UNSET;
+	llcf->response_buffer = NGX_CONF_UNSET_SIZE;
+	llcf->compress = NGX_CONF_UNSET;
+	llcf->compress_level = NGX_CONF_UNSET;
+	llcf->cache = NGX_CONF_UNSET_PTR;
+	llcf->cache_key = NGX_CONF_UNSET_PTR;
+	llcf->reload = NGX_CONF_UNSET;
 	if (ngx_array_init(&llcf->variables, cf->pool, 4, sizeof(lws_variable_t)) != NGX_OK) {
 		return NULL;
 	}
+	llcf->pool = llcf;
 	ngx_queue_init(&llcf->states);
 	ngx_queue_init(&llcf->requests);
 	llcf->qev.data = llcf;
 	llcf->qev.handler = lws_queue_handler;
 	llcf->qev.log = &cf->cycle->new_log;
+	llcf->dev.data = llcf;
+	llcf->dev.handler = lws_deadline_handler;
+	llcf->dev.log = &cf->cycle->new_log;
+	llcf->dev.cancelable = 1;
 
 	/* add cleanup */
 	cln = ngx_pool_cleanup_add(cf->pool, 0);
@@ -365,21 +680,70 @@ static char *lws_merge_loc_conf (ngx_conf_t *cf, void *parent, void *child) {
 	if (!conf->path_info) {
 		conf->path_info = prev->path_info;
 	}
+	if (!conf->coalesce_key) {
+		conf->coalesce_key = prev->coalesce_key;
+	}
 	ngx_conf_merge_str_value(conf->init, prev->init, "");
 	ngx_conf_merge_str_value(conf->pre, prev->pre, "");
 	ngx_conf_merge_str_value(conf->post, prev->post, "");
 	ngx_conf_merge_str_value(conf->path, prev->path, "");
 	ngx_conf_merge_str_value(conf->cpath, prev->cpath, "");
+	ngx_conf_merge_str_value(conf->pool_name, prev->pool_name, "");
+	ngx_conf_merge_size_value(conf->states_min, prev->states_min, 0);
 	ngx_conf_merge_size_value(conf->states_max, prev->states_max, LWS_STATES_MAX_DEFAULT);
+	if (conf->states_max > 0 && conf->states_min > conf->states_max) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "lws_min_states exceeds lws_max_states");
+		return NGX_CONF_ERROR;
+	}
+	ngx_conf_merge_value(conf->states_adaptive, prev->states_adaptive, 0);
+	if (conf->states_adaptive) {
+		if (conf->states_max == 0) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"lws_adaptive_states requires restricted lws_max_states");
+			return NGX_CONF_ERROR;
+		}
+
+		/* start at the number of CPUs, within bounds */
+		conf->states_limit = ngx_min((ngx_uint_t)ngx_ncpu, conf->states_max);
+		conf->states_limit = ngx_max(conf->states_limit, ngx_max(conf->states_min, 1));
+	}
 	ngx_conf_merge_size_value(conf->requests_max, prev->requests_max, LWS_REQUESTS_MAX_DEFAULT);
+	ngx_conf_merge_msec_value(conf->requests_wait_max, prev->requests_wait_max, 0);
+	ngx_conf_merge_msec_value(conf->codel_target, prev->codel_target, 0);
+	ngx_conf_merge_msec_value(conf->codel_interval, prev->codel_interval,
+			LWS_CODEL_INTERVAL_DEFAULT);
 	ngx_conf_merge_size_value(conf->state_memory_max, prev->state_memory_max, 0);
 	ngx_conf_merge_size_value(conf->state_gc, prev->state_gc, 0);
 	ngx_conf_merge_value(conf->state_requests_max, prev->state_requests_max, 0);
 	ngx_conf_merge_msec_value(conf->state_time_max, prev->state_time_max, 0);
 	ngx_conf_merge_msec_value(conf->state_timeout, prev->state_timeout, 0);
+	ngx_conf_merge_value(conf->state_jitter, prev->state_jitter, 0);
+	if (conf->state_jitter < 0 || conf->state_jitter > 100) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "lws_jitter must be between 0 and 100");
+		return NGX_CONF_ERROR;
+	}
+	ngx_conf_merge_msec_value(conf->state_replace, prev->state_replace, 0);
 	ngx_conf_merge_uint_value(conf->error_response, prev->error_response, 0);
 	ngx_conf_merge_value(conf->diagnostic, prev->diagnostic, 0);
 	ngx_conf_merge_value(conf->streaming, prev->streaming, 0);
+	ngx_conf_merge_value(conf->request_streaming, prev->request_streaming, 0);
+	ngx_conf_merge_size_value(conf->response_buffer, prev->response_buffer, 0);
+	ngx_conf_merge_value(conf->compress, prev->compress, 0);
+	ngx_conf_merge_value(conf->compress_level, prev->compress_level, LWS_COMPRESS_LEVEL_DEFAULT);
+	if (conf->compress_level < 1 || conf->compress_level > 9) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "lws_compress_level must be between 1 and 9");
+		return NGX_CONF_ERROR;
+	}
+	ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+	ngx_conf_merge_ptr_value(conf->cache_key, prev->cache_key, NULL);
+	ngx_conf_merge_value(conf->reload, prev->reload, 0);
+	if (conf->main && conf->coalesce_key) {
+		conf->coalesce = lws_table_create(32, &cf->cycle->new_log);
+		if (!conf->coalesce) {
+			return NGX_CONF_ERROR;
+		}
+		lws_table_set_dup(conf->coalesce, 1);
+	}
 	if (!ngx_array_push_n(&conf->variables, prev->variables.nelts)) {
 		return NGX_CONF_ERROR;
 	}
@@ -392,22 +756,19 @@ static char *lws_merge_loc_conf (ngx_conf_t *cf, void *parent, void *child) {
 }
 
 static void lws_cleanup_loc_conf (void *data) {
-	lws_state_t  *state;
-	ngx_queue_t  *q;
 	lws_loc_conf_t  *llcf;
 
 	llcf = data;
-	while (!ngx_queue_empty(&llcf->states)) {
-		q = ngx_queue_head(&llcf->states);
-		ngx_queue_remove(q);
-		state = ngx_queue_data(q, lws_state_t, queue);
-		lws_close_state(state, ngx_cycle->log);
+	lws_close_states(&llcf->states, ngx_cycle->log);
+	if (llcf->coalesce) {
+		lws_table_free(llcf->coalesce);
 	}
 }
 
 static char *lws (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
 	ngx_str_t                        *values;
-	lws_loc_conf_t                   *llcf;
+	lws_loc_conf_t                   *llcf, **llcfp;
+	lws_main_conf_t                  *lmcf;
 	ngx_http_core_loc_conf_t         *clcf;
 	ngx_http_compile_complex_value_t  ccv;
 
@@ -448,6 +809,14 @@ static char *lws (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
 		}
 	}
 
+	/* register location */
+	lmcf = ngx_http_conf_get_module_main_conf(cf, lws_module);
+	llcfp = ngx_array_push(&lmcf->locations);
+	if (!llcfp) {
+		return NGX_CONF_ERROR;
+	}
+	*llcfp = llcf;
+
 	/* install handler */
 	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
 	clcf->handler = lws_handler;
@@ -474,6 +843,28 @@ static char *lws_max_states (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
 	return NGX_CONF_OK;
 }
 
+static char *lws_codel (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_str_t       *values;
+	lws_loc_conf_t  *llcf;
+
+	values = cf->args->elts;
+	llcf = conf;
+	if (llcf->codel_target != NGX_CONF_UNSET_MSEC) {
+		return "is duplicate";
+	}
+	llcf->codel_target = ngx_parse_time(&values[1], 0);
+	if (llcf->codel_target == (ngx_msec_t)NGX_ERROR) {
+		return "has invalid target value";
+	}
+	if (cf->args->nelts >= 3) {
+		llcf->codel_interval = ngx_parse_time(&values[2], 0);
+		if (llcf->codel_interval == (ngx_msec_t)NGX_ERROR || llcf->codel_interval == 0) {
+			return "has invalid interval value";
+		}
+	}
+	return NGX_CONF_OK;
+}
+
 static char *lws_variable (ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
 	ngx_str_t       *values;
 	ngx_int_t        index;
@@ -523,58 +914,211 @@ static char *lws_error_response (ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 static ngx_int_t lws_init_process (ngx_cycle_t *cycle) {
+	size_t            n;
+	ngx_uint_t        i;
+	lws_loc_conf_t  **llcfp;
+	lws_main_conf_t  *lmcf;
+
 	if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) {
 		return NGX_OK;
 	}
 	if (lws_table_init_hash(cycle->log) != 0) {
 		return NGX_ERROR;
 	}
+
+	/* start executor */
+	lmcf = ngx_http_cycle_get_module_main_conf(cycle, lws_module);
+	if (!lmcf) {
+		return NGX_OK;
+	}
+	if (lmcf->executor_threads) {
+		lmcf->executor = lws_create_executor(lmcf->executor_threads, lmcf->executor_queue_max,
+				lmcf->executor_pin, cycle->log);
+		if (!lmcf->executor) {
+			return NGX_ERROR;
+		}
+	}
+
+	/* pre-warm Lua states */
+	llcfp = lmcf->locations.elts;
+	for (i = 0; i < lmcf->locations.nelts; i++) {
+		if (llcfp[i]->pool != llcfp[i]) {
+			continue;  /* pre-warmed by pool owner */
+		}
+		for (n = 0; n < llcfp[i]->states_min; n++) {
+			if (lws_warm_state(lmcf, llcfp[i], cycle->log) != NGX_OK) {
+				break;
+			}
+		}
+	}
+	return NGX_OK;
+}
+
+static void lws_exit_process (ngx_cycle_t *cycle) {
+	lws_main_conf_t  *lmcf;
+
+	lmcf = ngx_http_cycle_get_module_main_conf(cycle, lws_module);
+	if (lmcf && lmcf->executor) {
+		lws_destroy_executor(lmcf->executor);
+		lmcf->executor = NULL;
+	}
+}
+
+ngx_int_t lws_warm_state (lws_main_conf_t *lmcf, lws_loc_conf_t *llcf, ngx_log_t *log) {
+	lws_state_t        *state;
+	ngx_thread_task_t  *task;
+	lws_request_ctx_t  *ctx;
+
+	/* check limit */
+	if (llcf->states_max > 0 && llcf->states_n >= llcf->states_max) {
+		return NGX_DECLINED;
+	}
+
+	/* create state */
+	state = lws_create_state(lmcf, llcf, log);
+	if (!state) {
+		return NGX_ERROR;
+	}
+	state->in_use = 1;
+
+	/* setup task; the task carries a request context without request */
+	task = ngx_calloc(sizeof(ngx_thread_task_t) + sizeof(lws_request_ctx_t), log);
+	if (!task) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate thread task");
+		lws_close_state(state, log);
+		return NGX_ERROR;
+	}
+	ctx = (lws_request_ctx_t *)(task + 1);
+	ctx->llcf = llcf;
+	ctx->log = log;
+	ctx->state = state;
+	ctx->streaming_pipe[0] = ctx->streaming_pipe[1] = -1;
+	ctx->response_file.fd = NGX_INVALID_FILE;
+	task->ctx = ctx;
+	task->handler = lws_warm_thread_handler;
+	task->event.handler = lws_warm_finalization_handler;
+	task->event.data = ctx;
+
+	/* post task */
+	if (lws_post_task(lmcf, task) != NGX_OK) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to post thread task");
+		lws_close_state(state, log);
+		ngx_free(task);
+		return NGX_ERROR;
+	}
 	return NGX_OK;
 }
 
+static void lws_warm_thread_handler (void *data, ngx_log_t *log) {
+	lws_request_ctx_t  *ctx;
+
+	ctx = data;
+	ctx->rc = lws_run_state(ctx);
+}
+
+static void lws_warm_finalization_handler (ngx_event_t *ev) {
+	lws_loc_conf_t     *llcf;
+	lws_main_conf_t    *lmcf;
+	lws_request_ctx_t  *ctx;
+
+	/* release state; closes the state if the init chunk failed */
+	ctx = ev->data;
+	llcf = ctx->state->llcf;
+	lmcf = ctx->state->lmcf;
+	if (lmcf->executor) {
+		ctx->state->thread = ((ngx_thread_task_t *)ctx - 1)->id;
+	}
+	lws_release_state(ctx);
+
+	/* check for queued requests */
+	lws_trigger_queues(lmcf, llcf);
+
+	/* free task */
+	ngx_free(ctx->diagnostic.data);
+	ngx_free((ngx_thread_task_t *)ctx - 1);
+}
+
 
 /*
  * handler
  */
 
-static lws_file_status_e lws_get_file_status (ngx_http_request_t *r, ngx_str_t *filename) {
-	struct stat        sb;
-	lws_main_conf_t   *lmcf;
-	lws_file_status_e  fs;
+lws_file_status_e lws_get_file_status (lws_main_conf_t *lmcf, ngx_str_t *filename,
+		lws_file_version_t *version, ngx_log_t *log) {
+	struct stat         sb;
+	lws_file_stat_t    *st;
+	lws_file_status_e   fs;
+	lws_file_version_t  v;
 
-	lmcf = ngx_http_get_module_main_conf(r, lws_module);
+	/* check stat cache; the cache is shared with the thread pool */
 	if (lmcf->stat_cache) {
-		fs = (uintptr_t)lws_table_get(lmcf->stat_cache, filename);
-		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"[LWS] stat_cache get filename:%V fs:%d", filename, fs);
-		if (fs != LWS_FS_UNKNOWN) {
+		if (ngx_thread_mutex_lock(&lmcf->stat_cache_mutex, log) != NGX_OK) {
+			return LWS_FS_ERROR;
+		}
+		st = lws_table_get(lmcf->stat_cache, filename);
+		if (st) {
+			fs = st->fs;
+			if (version) {
+				*version = st->version;
+			}
+		}
+		(void)ngx_thread_mutex_unlock(&lmcf->stat_cache_mutex, log);
+		if (st) {
+			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+					"[LWS] stat_cache get filename:%V fs:%d", filename, fs);
 			return fs;
 		}
 	}
-	fs = stat((const char *)filename->data, &sb) == 0 && S_ISREG(sb.st_mode) ? LWS_FS_FOUND
-			: LWS_FS_NOT_FOUND;
+
+	/* stat */
+	if (stat((const char *)filename->data, &sb) == 0 && S_ISREG(sb.st_mode)) {
+		fs = LWS_FS_FOUND;
+		lws_get_file_version(&sb, &v);
+	} else {
+		fs = LWS_FS_NOT_FOUND;
+		ngx_memzero(&v, sizeof(v));
+	}
+	if (version) {
+		*version = v;
+	}
+
+	/* update stat cache */
 	if (lmcf->stat_cache) {
-		lws_table_set(lmcf->stat_cache, filename, (void *)fs);
-		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		st = ngx_alloc(sizeof(lws_file_stat_t), log);
+		if (!st) {
+			return fs;
+		}
+		st->fs = fs;
+		st->version = v;
+		if (ngx_thread_mutex_lock(&lmcf->stat_cache_mutex, log) != NGX_OK) {
+			ngx_free(st);
+			return fs;
+		}
+		if (lws_table_set(lmcf->stat_cache, filename, st) != 0) {
+			ngx_free(st);
+		}
+		(void)ngx_thread_mutex_unlock(&lmcf->stat_cache_mutex, log);
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
 				"[LWS] stat_cache set filename:%V fs:%d", filename, fs);
 	}
 	return fs;
 }
 
+void lws_get_file_version (struct stat *sb, lws_file_version_t *version) {
+	/* nanoseconds and inode catch rewrites within a second, or preserving the modification
+	   time; zeroed, so that versions compare as bytes */
+	ngx_memzero(version, sizeof(lws_file_version_t));
+	version->mtime = sb->st_mtim.tv_sec;
+	version->mtime_nsec = sb->st_mtim.tv_nsec;
+	version->ino = sb->st_ino;
+	version->size = sb->st_size;
+}
+
 static ngx_int_t lws_handler (ngx_http_request_t *r) {
-	ngx_int_t                   rc;
-	ngx_log_t                  *log;
-	ngx_str_t                   main;
-	ngx_str_t                  *key, *value;
-	ngx_uint_t                  i;
-	ngx_list_part_t            *part;
-	ngx_table_elt_t            *headers;
-	lws_loc_conf_t             *llcf;
-	lws_request_header_t       *request_header;
-	lws_variable_t             *variables;
-	lws_request_ctx_t          *ctx;;
-	ngx_pool_cleanup_t         *cln;
-	ngx_http_variable_value_t  *variable_value;
+	ngx_int_t        rc;
+	ngx_log_t       *log;
+	ngx_str_t        cache_key, coalesce_key;
+	lws_loc_conf_t  *llcf;
 
 	/* check if enabled */
 	llcf = ngx_http_get_module_loc_conf(r, lws_module);
@@ -582,6 +1126,45 @@ static ngx_int_t lws_handler (ngx_http_request_t *r) {
 		return NGX_DECLINED;
 	}
 
+	/* serve from cache on the event loop, without a Lua state */
+	log = r->connection->log;
+	ngx_str_null(&cache_key);
+	if (llcf->cache && (r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+		if (lws_get_response_key(r, llcf, llcf->cache_key, &cache_key) != NGX_OK) {
+			ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] failed to evaluate cache key");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+		rc = lws_serve_cached_response(r, llcf, &cache_key);
+		if (rc != NGX_DECLINED) {
+			return rc;
+		}
+	}
+
+	/* follow an identical request in progress on the event loop, without a Lua state */
+	ngx_str_null(&coalesce_key);
+	if (llcf->coalesce && r->method == NGX_HTTP_GET) {
+		if (lws_get_response_key(r, llcf, llcf->coalesce_key, &coalesce_key) != NGX_OK) {
+			ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] failed to evaluate coalescing key");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+		rc = lws_follow_request(r, llcf, &coalesce_key, &cache_key);
+		if (rc != NGX_DECLINED) {
+			return rc;
+		}
+	}
+
+	return lws_start_request(r, llcf, &cache_key, &coalesce_key);
+}
+
+ngx_int_t lws_start_request (ngx_http_request_t *r, lws_loc_conf_t *llcf, ngx_str_t *cache_key,
+		ngx_str_t *coalesce_key) {
+	ngx_int_t            rc;
+	ngx_log_t           *log;
+	ngx_str_t            main;
+	lws_main_conf_t     *lmcf;
+	lws_request_ctx_t   *ctx;
+	ngx_pool_cleanup_t  *cln;
+
 	/* check main */
 	log = r->connection->log;
 	if (ngx_http_complex_value(r, llcf->main, &main) != NGX_OK) {
@@ -589,8 +1172,25 @@ static ngx_int_t lws_handler (ngx_http_request_t *r) {
 		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "[LWS] main filename:%V", &main);
-	if (lws_get_file_status(r, &main) == LWS_FS_NOT_FOUND) {
+	lmcf = ngx_http_get_module_main_conf(r, lws_module);
+	switch (lws_get_file_status(lmcf, &main, NULL, log)) {
+	case LWS_FS_NOT_FOUND:
 		return NGX_HTTP_NOT_FOUND;
+
+	case LWS_FS_ERROR:
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	default:
+		break;
+	}
+
+	/* admit early, so that rejected requests neither read their body nor allocate resources;
+	   re-checked when the body completes */
+	if (!lws_can_run(lmcf, llcf->pool) && llcf->pool->requests_max > 0
+			&& llcf->pool->requests_n >= llcf->pool->requests_max) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] request queue overflow n:%z max:%z",
+				llcf->pool->requests_n, llcf->pool->requests_max);
+		return lws_retry_after(r);
 	}
 
 	/* prepare request context */
@@ -600,6 +1200,7 @@ static ngx_int_t lws_handler (ngx_http_request_t *r) {
 		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 	ctx->streaming_pipe[0] = ctx->streaming_pipe[1] = -1;
+	ctx->response_file.fd = NGX_INVALID_FILE;
 	ngx_http_set_ctx(r, ctx, lws_module);
 	cln = ngx_pool_cleanup_add(r->pool, 0);
 	if (!cln) {
@@ -609,18 +1210,378 @@ static ngx_int_t lws_handler (ngx_http_request_t *r) {
 	cln->handler = lws_cleanup_request_ctx;
 	cln->data = ctx;
 	ctx->r = r;
+	ctx->llcf = llcf;
+	ctx->log = log;
 	ctx->main = main;
+	ctx->status = NGX_HTTP_OK;
+	if (r->method == NGX_HTTP_GET) {
+		ctx->cache_key = *cache_key;  /* only GET responses are cached */
+	}
 	if (llcf->path_info && ngx_http_complex_value(r, llcf->path_info, &ctx->path_info)
 			!= NGX_OK) {
 		ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] failed to evaluate path info");
 		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 
+	/* lead identical requests arriving while this one runs */
+	if (coalesce_key && coalesce_key->len && lws_lead_request(ctx, coalesce_key) != NGX_OK) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	/* read request body; when streaming, the body handler runs as soon as data is available */
+	if (llcf->request_streaming) {
+		r->request_body_no_buffering = 1;
+	}
+	rc = ngx_http_read_client_request_body(r, lws_body_handler);
+	if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+		return rc;
+	}
+	return NGX_DONE;
+}
+
+static void lws_body_handler (ngx_http_request_t *r) {
+	ngx_int_t           rc;
+	ngx_log_t          *log;
+	lws_loc_conf_t     *llcf;
+	lws_main_conf_t    *lmcf;
+	lws_request_ctx_t  *ctx;
+
+	/* prepare request body */
+	log = r->connection->log;
+	ctx = ngx_http_get_module_ctx(r, lws_module);
+	if (!r->request_body) {
+		ngx_log_error(NGX_LOG_ERR, log, errno, "[LWS] missing request body");
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+	if (r->request_body_no_buffering) {
+		/* body still arriving */
+		rc = lws_open_request_stream(ctx);
+		if (rc != NGX_OK) {
+			ngx_http_finalize_request(r, rc == NGX_ERROR ? NGX_HTTP_INTERNAL_SERVER_ERROR : rc);
+			return;
+		}
+	} else {
+		if (r->request_body->temp_file) {
+			ctx->request_body = fdopen(r->request_body->temp_file->file.fd, "rb");
+		} else {
+			ctx->cl = r->request_body->bufs;
+			ctx->cl_pos = ctx->cl ? ctx->cl->buf->pos : NULL;
+			ctx->request_body = fopencookie(ctx, "rb", lws_request_read_functions);
+		}
+		if (!ctx->request_body) {
+			ngx_log_error(NGX_LOG_ERR, log, errno, "[LWS] failed to open request body stream");
+			ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+			return;
+		}
+	}
+
+	/* proceed, queue, or abort */
+	llcf = ctx->llcf->pool;
+	lmcf = ngx_http_get_module_main_conf(r, lws_module);
+	if (lws_can_run(lmcf, llcf)) {
+		lws_state_handler(ctx);
+	} else if (llcf->requests_max == 0 || llcf->requests_n < llcf->requests_max) {
+		lws_queue_request(lmcf, llcf, ctx);
+		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "[LWS] request queued n:%z max:%z",
+				llcf->requests_n, llcf->requests_max);
+	} else {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] request queue overflow n:%z max:%z",
+				llcf->requests_n, llcf->requests_max);
+		lws_shed_request(r);
+	}
+}
+
+static void lws_queue_request (lws_main_conf_t *lmcf, lws_loc_conf_t *llcf,
+		lws_request_ctx_t *ctx) {
+	ngx_http_cleanup_t  *cln;
+	ngx_http_request_t  *r;
+
+	/* queue */
+	llcf->requests_n++;
+	if (lmcf->monitor) {
+		ngx_atomic_fetch_add(&lmcf->monitor->requests_n, 1);
+	}
+	ctx->queued = ngx_current_msec;
+	ctx->in_queue = 1;
+	ngx_queue_insert_tail(&llcf->requests, &ctx->queue);
+
+	/* prune the request if the client disconnects while queued; terminating the request runs
+	   the cleanup right away; a streaming request body detects disconnects itself */
+	r = ctx->r;
+	cln = ngx_http_cleanup_add(r, 0);
+	if (cln) {
+		cln->handler = lws_cleanup_queued_request;
+		cln->data = ctx;
+	}
+	if (!ctx->request_conn) {
+		r->read_event_handler = ngx_http_test_reading;
+		if (ngx_handle_read_event(r->connection->read, 0) != NGX_OK) {
+			ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "[LWS] failed to handle read event");
+		}
+	}
+
+	/* arm deadline */
+	if (llcf->requests_wait_max > 0 && !llcf->dev.timer_set) {
+		ngx_add_timer(&llcf->dev, llcf->requests_wait_max);
+	}
+}
+
+static void lws_dequeue_request (lws_main_conf_t *lmcf, lws_loc_conf_t *llcf,
+		lws_request_ctx_t *ctx) {
+	ngx_queue_remove(&ctx->queue);
+	ctx->in_queue = 0;
+	llcf->requests_n--;
+	if (lmcf->monitor) {
+		ngx_atomic_fetch_add(&lmcf->monitor->requests_n, -1);
+	}
+	if (ngx_queue_empty(&llcf->requests) && llcf->dev.timer_set) {
+		ngx_del_timer(&llcf->dev);
+	}
+	if (!ctx->request_conn) {
+		ctx->r->read_event_handler = ngx_http_block_reading;
+	}
+}
+
+static void lws_cleanup_queued_request (void *data) {
+	lws_loc_conf_t     *llcf;
+	lws_main_conf_t    *lmcf;
+	lws_request_ctx_t  *ctx;
+
+	ctx = data;
+	if (ctx->in_queue) {
+		llcf = ctx->llcf->pool;
+		lmcf = ngx_http_get_module_main_conf(ctx->r, lws_module);
+		lws_dequeue_request(lmcf, llcf, ctx);
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "[LWS] queued request pruned");
+	}
+}
+
+static ngx_uint_t lws_codel_shed (lws_loc_conf_t *llcf, ngx_msec_t sojourn, ngx_msec_t now) {
+	ngx_uint_t  ok_to_drop;
+
+	/* has the queue wait stayed above target for an interval? */
+	if (sojourn < llcf->codel_target || ngx_queue_empty(&llcf->requests)) {
+		llcf->codel_first_above = 0;
+		ok_to_drop = 0;
+	} else if (llcf->codel_first_above == 0) {
+		llcf->codel_first_above = now + llcf->codel_interval;
+		ok_to_drop = 0;
+	} else {
+		ok_to_drop = (ngx_msec_int_t)(now - llcf->codel_first_above) >= 0;
+	}
+
+	/* in dropping state, drop at the pace of the control law until below target */
+	if (llcf->codel_dropping) {
+		if (!ok_to_drop) {
+			llcf->codel_dropping = 0;
+			return 0;
+		}
+		if ((ngx_msec_int_t)(now - llcf->codel_drop_next) >= 0) {
+			llcf->codel_count++;
+			llcf->codel_drop_next = lws_codel_control(llcf, llcf->codel_drop_next);
+			return 1;
+		}
+		return 0;
+	}
+
+	/* enter dropping state; resume the previous drop rate if it ended recently */
+	if (ok_to_drop) {
+		llcf->codel_dropping = 1;
+		if (llcf->codel_count > 2 && (ngx_msec_int_t)(now - llcf->codel_drop_next)
+				< (ngx_msec_int_t)(16 * llcf->codel_interval)) {
+			llcf->codel_count -= 2;
+		} else {
+			llcf->codel_count = 1;
+		}
+		llcf->codel_drop_next = lws_codel_control(llcf, now);
+		return 1;
+	}
+	return 0;
+}
+
+static ngx_msec_t lws_codel_control (lws_loc_conf_t *llcf, ngx_msec_t t) {
+	ngx_uint_t  root;
+
+	/* t + interval / sqrt(count) */
+	root = 1;
+	while ((root + 1) * (root + 1) <= llcf->codel_count) {
+		root++;
+	}
+	return t + llcf->codel_interval / root;
+}
+
+static ngx_int_t lws_retry_after (ngx_http_request_t *r) {
+	ngx_table_elt_t  *h;
+
+	h = ngx_list_push(&r->headers_out.headers);
+	if (h) {
+		ngx_str_set(&h->key, "Retry-After");
+		ngx_str_set(&h->value, LWS_RETRY_AFTER);
+		h->hash = 1;
+	}
+	return NGX_HTTP_SERVICE_UNAVAILABLE;
+}
+
+static void lws_shed_request (ngx_http_request_t *r) {
+	ngx_http_finalize_request(r, lws_retry_after(r));
+}
+
+static ngx_int_t lws_can_run (lws_main_conf_t *lmcf, lws_loc_conf_t *llcf) {
+	/* a Lua state must be available, and the executor must accept the task */
+	if (ngx_queue_empty(&llcf->states) && llcf->states_max > 0
+			&& llcf->states_n >= llcf->states_max) {
+		return 0;
+	}
+	if (llcf->states_adaptive && llcf->states_active >= llcf->states_limit) {
+		return 0;
+	}
+	return !lmcf->executor || lws_executor_available(lmcf->executor);
+}
+
+static void lws_adapt_states (lws_loc_conf_t *llcf, ngx_uint_t latency) {
+	ngx_uint_t  limit;
+
+	/* track the baseline as the minimum latency over a sliding window of samples */
+	if (llcf->latency_window_n == 0 || latency < llcf->latency_window_min) {
+		llcf->latency_window_min = latency;
+	}
+	if (++llcf->latency_window_n >= LWS_ADAPTIVE_WINDOW) {
+		llcf->latency_baseline = llcf->latency_window_min;
+		llcf->latency_window_n = 0;
+	}
+	if (llcf->latency_baseline == 0 || latency < llcf->latency_baseline) {
+		llcf->latency_baseline = latency;
+	}
+
+	/* AIMD, changing the limit at most once per round of samples: decrease multiplicatively
+	   when even the fastest request of the round exceeds the baseline by the tolerance;
+	   increase additively when the limit holds back queued requests */
+	if (llcf->states_samples == 0 || latency < llcf->latency_round_min) {
+		llcf->latency_round_min = latency;
+	}
+	if (++llcf->states_samples < llcf->states_limit) {
+		return;
+	}
+	limit = llcf->states_limit;
+	if (llcf->latency_round_min > llcf->latency_baseline * LWS_ADAPTIVE_TOLERANCE) {
+		limit = ngx_max(limit * 9 / 10, ngx_max(llcf->states_min, 1));
+		if (limit == llcf->states_limit && limit > ngx_max(llcf->states_min, 1)) {
+			limit--;
+		}
+	} else if (!ngx_queue_empty(&llcf->requests) && limit < llcf->states_max) {
+		limit++;
+	}
+	if (limit != llcf->states_limit) {
+		ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+				"[LWS] adaptive states limit:%ui->%ui latency:%ui baseline:%ui",
+				llcf->states_limit, limit, llcf->latency_round_min, llcf->latency_baseline);
+		llcf->states_limit = limit;
+	}
+	llcf->states_samples = 0;
+}
+
+static void lws_trigger_queues (lws_main_conf_t *lmcf, lws_loc_conf_t *llcf) {
+	ngx_uint_t        i;
+	lws_loc_conf_t  **llcfp;
+
+	/* with the executor, a completed task frees capacity for all locations */
+	if (lmcf->executor) {
+		llcfp = lmcf->locations.elts;
+		for (i = 0; i < lmcf->locations.nelts; i++) {
+			if (!ngx_queue_empty(&llcfp[i]->requests) && !llcfp[i]->qev.timer_set) {
+				ngx_add_timer(&llcfp[i]->qev, 0);
+			}
+		}
+		return;
+	}
+	if (!ngx_queue_empty(&llcf->requests) && !llcf->qev.timer_set) {
+		ngx_add_timer(&llcf->qev, 0);
+	}
+}
+
+static void lws_queue_handler (ngx_event_t *ev) {
+	ngx_msec_t          now, sojourn;
+	ngx_queue_t        *q;
+	lws_loc_conf_t     *llcf;
+	ngx_connection_t   *c;
+	lws_main_conf_t    *lmcf;
+	lws_request_ctx_t  *ctx;
+
+	llcf = ev->data;
+	lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
+	now = ngx_current_msec;
+	while (!ngx_queue_empty(&llcf->requests) && lws_can_run(lmcf, llcf)) {
+		q = ngx_queue_head(&llcf->requests);
+		ctx = ngx_queue_data(q, lws_request_ctx_t, queue);
+		lws_dequeue_request(lmcf, llcf, ctx);
+		c = ctx->r->connection;
+
+		/* shed requests that waited too long */
+		sojourn = now - ctx->queued;
+		if (llcf->requests_wait_max > 0 && sojourn >= llcf->requests_wait_max) {
+			ngx_log_error(NGX_LOG_WARN, ctx->log, 0, "[LWS] request queue wait exceeded "
+					"wait:%M max:%M", sojourn, llcf->requests_wait_max);
+			lws_shed_request(ctx->r);
+		} else if (llcf->codel_target > 0 && lws_codel_shed(llcf, sojourn, now)) {
+			ngx_log_error(NGX_LOG_WARN, ctx->log, 0, "[LWS] request shed wait:%M count:%ui",
+					sojourn, llcf->codel_count);
+			lws_shed_request(ctx->r);
+		} else {
+			lws_state_handler(ctx);
+		}
+		ngx_http_run_posted_requests(c);
+	}
+}
+
+static void lws_deadline_handler (ngx_event_t *ev) {
+	ngx_msec_t          now, sojourn;
+	ngx_queue_t        *q;
+	lws_loc_conf_t     *llcf;
+	ngx_connection_t   *c;
+	lws_main_conf_t    *lmcf;
+	lws_request_ctx_t  *ctx;
+
+	/* shed expired requests from the head of the queue, which holds the oldest requests */
+	llcf = ev->data;
+	lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
+	now = ngx_current_msec;
+	while (!ngx_queue_empty(&llcf->requests)) {
+		q = ngx_queue_head(&llcf->requests);
+		ctx = ngx_queue_data(q, lws_request_ctx_t, queue);
+		sojourn = now - ctx->queued;
+		if (sojourn < llcf->requests_wait_max) {
+			ngx_add_timer(ev, llcf->requests_wait_max - sojourn);
+			return;
+		}
+		lws_dequeue_request(lmcf, llcf, ctx);
+		ngx_log_error(NGX_LOG_WARN, ctx->log, 0, "[LWS] request queue wait exceeded "
+				"wait:%M max:%M", sojourn, llcf->requests_wait_max);
+		c = ctx->r->connection;
+		lws_shed_request(ctx->r);
+		ngx_http_run_posted_requests(c);
+	}
+}
+
+static ngx_int_t lws_prepare_request (lws_request_ctx_t *ctx) {
+	ngx_str_t                  *value;
+	ngx_uint_t                  i;
+	ngx_log_t                  *log;
+	lws_loc_conf_t             *llcf;
+	lws_variable_t             *variables;
+	ngx_http_request_t         *r;
+	ngx_http_variable_value_t  *variable_value;
+
+	/* runs at dispatch, so that queued requests hold no resources beyond their body */
+	r = ctx->r;
+	llcf = ctx->llcf;
+	log = ctx->log;
+
 	/* prepare request variables */
 	ctx->variables = lws_table_create(llcf->variables.nelts, log);
 	if (!ctx->variables) {
 		ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] failed to create variables");
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		return NGX_ERROR;
 	}
 	variables = llcf->variables.elts;
 	for (i = 0; i < llcf->variables.nelts; i++) {
@@ -631,71 +1592,13 @@ static ngx_int_t lws_handler (ngx_http_request_t *r) {
 		value = ngx_palloc(r->pool, sizeof(ngx_str_t));
 		if (!value) {
 			ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] failed to allocate variable");
-			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+			return NGX_ERROR;
 		}
 		value->len = variable_value->len;
 		value->data = variable_value->data;
 		if (lws_table_set(ctx->variables, &variables[i].name, value) != 0) {
 			ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] failed to set variable");
-			return NGX_HTTP_INTERNAL_SERVER_ERROR;
-		}
-	}
-
-	/* prepare request headers */
-	ctx->request_headers = lws_table_create(32, log);
-	if (!ctx->request_headers) {
-		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to create request headers");
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
-	}
-	lws_table_set_ci(ctx->request_headers, 1);
-	for (part = &r->headers_in.headers.part; part; part = part->next) {
-		headers = part->elts;
-		for (i = 0; i < part->nelts; i++) {
-			request_header = lws_table_get(ctx->request_headers, &headers[i].key);
-			if (!request_header) {
-				request_header = ngx_palloc(r->pool, sizeof(lws_request_header_t));
-				if (!request_header) {
-					ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate header");
-					return NGX_HTTP_INTERNAL_SERVER_ERROR;
-				}
-				request_header->value = headers[i].value;
-				request_header->last = NULL;
-				request_header->count = 1;
-				if (lws_table_set(ctx->request_headers, &headers[i].key, &request_header->value)
-						!= 0) {
-					ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to set header");
-					return NGX_HTTP_INTERNAL_SERVER_ERROR;
-				}
-			} else {
-				request_header->value.len += 2 + headers[i].value.len;
-				request_header->count++;
-			}
-		}
-	}
-	key = NULL;
-	while (lws_table_next(ctx->request_headers, key, &key, (void**)&request_header) == 0) {
-		if (request_header->count > 1) {
-			request_header->value.data = ngx_palloc(r->pool, request_header->value.len);
-			if (!request_header->value.data) {
-				ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate header");
-				return NGX_HTTP_INTERNAL_SERVER_ERROR;
-			}
-		}
-	}
-	for (part = &r->headers_in.headers.part; part; part = part->next) {
-		headers = part->elts;
-		for (i = 0; i < part->nelts; i++) {
-			request_header = lws_table_get(ctx->request_headers, &headers[i].key);
-			if (request_header->count == 1) {
-				continue;
-			}
-			if (request_header->last) {
-				request_header->last = lws_cpylit(request_header->last, ", ");
-			} else {
-				request_header->last = request_header->value.data;
-			}
-			request_header->last = ngx_cpymem(request_header->last, headers[i].value.data,
-					headers[i].value.len);
+			return NGX_ERROR;
 		}
 	}
 
@@ -703,189 +1606,449 @@ static ngx_int_t lws_handler (ngx_http_request_t *r) {
 	ctx->response_headers = lws_table_create(8, log);
 	if (!ctx->response_headers) {
 		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to create response headers");
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		return NGX_ERROR;
 	}
 	lws_table_set_dup(ctx->response_headers, 1);
 	lws_table_set_free(ctx->response_headers, 1);
 	lws_table_set_ci(ctx->response_headers, 1);
-	ctx->status = NGX_HTTP_OK;
 
-	/* prepare response body */
-	ctx->response_body = open_memstream((char **)&ctx->response_body_str.data,
-			&ctx->response_body_str.len);
+	/* prepare response body; only main responses are compressed, as subrequest responses are
+	   typically included in other responses */
+	ctx->vary = llcf->compress && r == r->main;
+	ctx->compress = ctx->vary && r->method != NGX_HTTP_HEAD && lws_accept_gzip(r);
+	ctx->response_body = fopencookie(ctx, "wb", lws_response_write_functions);
 	if (!ctx->response_body) {
 		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to open response body stream");
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		return NGX_ERROR;
 	}
 	if (llcf->streaming) {
 		if (pipe(ctx->streaming_pipe) != 0) {
 			ngx_log_error(NGX_LOG_CRIT, log, errno,
 					"[LWS] failed to create response streaming pipe");
-			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+			return NGX_ERROR;
 		}
 		if (ngx_nonblocking(ctx->streaming_pipe[0]) == -1) {
 			ngx_log_error(NGX_LOG_CRIT, log, errno,
 					"[LWS] failed to make response streaming pipe nonblocking");
-			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+			return NGX_ERROR;
 		}
 		ctx->streaming_conn = ngx_get_connection(ctx->streaming_pipe[0], log);
 		if (!ctx->streaming_conn) {
 			ngx_log_error(NGX_LOG_CRIT, log, 0,
 					"[LWS] failed to get response streaming connection");
-			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+			return NGX_ERROR;
 		}
 		ctx->streaming_conn->data = ctx;
 		ctx->streaming_conn->read->log = log;
 		ctx->streaming_conn->read->handler = lws_stream_handler;
 		if (ngx_handle_read_event(ctx->streaming_conn->read, 0) != NGX_OK) {
 			ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to add response streaming event");
-			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+			return NGX_ERROR;
 		}
 	}
-
-	/* read request body */
-	rc = ngx_http_read_client_request_body(r, lws_body_handler);
-	if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
-		return rc;
-	}
-	return NGX_DONE;
+	return NGX_OK;
 }
 
-static void lws_body_handler (ngx_http_request_t *r) {
-	ngx_log_t          *log;
-	lws_loc_conf_t     *llcf;
-	lws_main_conf_t    *lmcf;
-	lws_request_ctx_t  *ctx;
+static void lws_state_handler (lws_request_ctx_t *ctx) {
+	ngx_log_t           *log;
+	lws_main_conf_t     *lmcf;
+	ngx_thread_task_t   *task;
+	ngx_http_request_t  *r;
 
-	/* prepare request body */
-	log = r->connection->log;
-	ctx = ngx_http_get_module_ctx(r, lws_module);
-	if (!r->request_body) {
-		ngx_log_error(NGX_LOG_ERR, log, errno, "[LWS] missing request body");
+	/* prepare request, acquire state */
+	r = ctx->r;
+	if (lws_prepare_request(ctx) != NGX_OK || lws_acquire_state(ctx) != 0) {
 		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
 		return;
 	}
-	if (r->request_body->temp_file) {
-		ctx->request_body = fdopen(r->request_body->temp_file->file.fd, "rb");
-	} else {
-		ctx->cl = r->request_body->bufs;
-		ctx->request_body = fopencookie(ctx, "rb", lws_request_read_functions);
+
+	/* setup task */
+	log = r->connection->log;
+	task = ngx_thread_task_alloc(r->pool, sizeof(lws_request_ctx_t *));
+	if (!task) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate thread task");
+		lws_release_state(ctx);
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
 	}
-	if (!ctx->request_body) {
-		ngx_log_error(NGX_LOG_ERR, log, errno, "[LWS] failed to open request body stream");
+	*(lws_request_ctx_t **)task->ctx = ctx;
+	task->handler = lws_thread_handler;
+	task->event.handler = lws_finalization_handler;
+	task->event.data = ctx;
+	task->id = ctx->state->thread;  /* executor affinity */
+	ctx->task = task;
+
+	/* post task */
+	lmcf = ngx_http_get_module_main_conf(r, lws_module);
+	if (lws_post_task(lmcf, task) != NGX_OK) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to post thread task");
+		lws_release_state(ctx);
 		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
 		return;
 	}
+}
 
-	/* proceed, queue, or abort */
-	llcf = ngx_http_get_module_loc_conf(r, lws_module);
-	if (!ngx_queue_empty(&llcf->states) || llcf->states_max == 0
-			|| llcf->states_n < llcf->states_max) {
-		lws_state_handler(ctx);
-	} else if (llcf->requests_max == 0 || llcf->requests_n < llcf->requests_max) {
-		llcf->requests_n++;
-		lmcf = ngx_http_get_module_main_conf(r, lws_module);
-		if (lmcf->monitor) {
-			ngx_atomic_fetch_add(&lmcf->monitor->requests_n, 1);
+static void lws_thread_handler (void *data, ngx_log_t *log) {
+	ngx_uint_t          measure;
+	struct timespec     start, end;
+	lws_request_ctx_t  *ctx;
+
+	/* run, measuring execution latency of created Lua states if adaptive */
+	ctx = *(lws_request_ctx_t **)data;
+	measure = ctx->state->llcf->states_adaptive && ctx->state->L
+			&& clock_gettime(CLOCK_MONOTONIC, &start) == 0;
+	ctx->rc = lws_run_state(ctx);
+	(void)lws_compress_response_body(ctx);  /* buffered: uncompressed fallback; streamed: abort */
+	if (measure && clock_gettime(CLOCK_MONOTONIC, &end) == 0) {
+		ctx->latency = (end.tv_sec - start.tv_sec) * 1000000
+				+ (end.tv_nsec - start.tv_nsec) / 1000;
+		if (ctx->latency == 0) {
+			ctx->latency = 1;
 		}
-		ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "[LWS] request queued n:%z max:%z",
-				llcf->requests_n, llcf->requests_max);
-		ngx_queue_insert_tail(&llcf->requests, &ctx->queue);
-	} else {
-		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] request queue overflow n:%z max:%z",
-				llcf->requests_n, llcf->requests_max);
-		ngx_http_finalize_request(r, NGX_HTTP_SERVICE_UNAVAILABLE);
 	}
 }
 
-static void lws_queue_handler (ngx_event_t *ev) {
-	ngx_queue_t        *q;
-	lws_loc_conf_t     *llcf;
-	lws_main_conf_t    *lmcf;
+static ssize_t lws_read_handler (void *cookie, char *buf, size_t size) {
+	size_t              count;
+	ngx_buf_t          *b;
 	lws_request_ctx_t  *ctx;
 
-	llcf = ev->data;
-	lmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, lws_module);
-	while (!ngx_queue_empty(&llcf->requests) && (!ngx_queue_empty(&llcf->states)
-			|| llcf->states_max == 0 || llcf->states_n < llcf->states_max)) {
-		q = ngx_queue_head(&llcf->requests);
-		ngx_queue_remove(q);
-		llcf->requests_n--;
-		if (lmcf->monitor) {
-			ngx_atomic_fetch_add(&lmcf->monitor->requests_n, -1);
+	/* skip consumed and empty buffers; the chain itself is left intact for lws.getbody */
+	ctx = cookie;
+	while (ctx->cl && ctx->cl_pos == ctx->cl->buf->last) {
+		ctx->cl = ctx->cl->next;
+		ctx->cl_pos = ctx->cl ? ctx->cl->buf->pos : NULL;
+	}
+
+	/* done? */
+	if (!ctx->cl) {
+		return 0;
+	}
+
+	/* read */
+	b = ctx->cl->buf;
+	count = b->last - ctx->cl_pos;
+	if (count > size) {
+		count = size;
+	}
+	ngx_memcpy(buf, ctx->cl_pos, count);
+	ctx->cl_pos += count;
+	return count;
+}
+
+static ssize_t lws_stream_read_handler (void *cookie, char *buf, size_t size) {
+	ssize_t             n;
+	lws_request_ctx_t  *ctx;
+
+	/* EOF after a failed body is an error, so Lua does not take a truncated body as complete;
+	   the code is set before the event loop closes the write end */
+	ctx = cookie;
+	do {
+		n = read(ctx->request_pipe, buf, size);
+	} while (n == -1 && errno == EINTR);
+	if (n == 0 && ctx->request_body_rc != NGX_OK) {
+		errno = EIO;
+		return -1;
+	}
+	return n;
+}
+
+static int lws_stream_close_handler (void *cookie) {
+	lws_request_ctx_t  *ctx;
+
+	ctx = cookie;
+	return close(ctx->request_pipe);
+}
+
+static ssize_t lws_write_handler (void *cookie, const char *buf, size_t size) {
+	size_t              count, n;
+	ssize_t             written;
+	ngx_buf_t          *b;
+	ngx_chain_t        *cl;
+	lws_request_ctx_t  *ctx;
+
+	/* spill to a temp file above the in-memory limit */
+	ctx = cookie;
+	if (ctx->response_file.fd == NGX_INVALID_FILE && ctx->llcf->response_buffer
+			&& ctx->response_len + size > ctx->llcf->response_buffer) {
+		if (lws_spill_response_body(ctx) != 0) {
+			errno = EIO;
+			return 0;
 		}
-		ctx = ngx_queue_data(q, lws_request_ctx_t, queue);
-		lws_state_handler(ctx);
 	}
+	if (ctx->response_file.fd != NGX_INVALID_FILE) {
+		for (count = 0; count < size; count += written) {
+			written = write(ctx->response_file.fd, buf + count, size - count);
+			if (written == -1) {
+				if (errno == EINTR) {
+					written = 0;
+					continue;
+				}
+				ngx_log_error(NGX_LOG_CRIT, ctx->log, errno,
+						"[LWS] failed to write response body temp file");
+				break;
+			}
+		}
+		ctx->response_len += count;
+		return count;
+	}
+
+	/* append to fixed-size chunks; this runs in the thread pool, so chunks are allocated
+	   outside the request pool and freed by the request cleanup */
+	for (count = 0; count < size; count += n) {
+		cl = ctx->response_last;
+		if (!cl || cl->buf->last == cl->buf->end) {
+			cl = lws_alloc_response_chunk(ctx->log);
+			if (!cl) {
+				errno = ENOMEM;
+				ctx->response_len += count;
+				return count;
+			}
+			if (ctx->response_last) {
+				ctx->response_last->next = cl;
+			} else {
+				ctx->response_cl = cl;
+			}
+			ctx->response_last = cl;
+		}
+		b = ctx->response_last->buf;
+		n = ngx_min((size_t)(b->end - b->last), size - count);
+		b->last = ngx_cpymem(b->last, buf + count, n);
+	}
+	ctx->response_len += size;
+	return size;
 }
 
-static void lws_state_handler (lws_request_ctx_t *ctx) {
+ngx_chain_t *lws_alloc_response_chunk (ngx_log_t *log) {
+	u_char       *p;
+	ngx_buf_t    *b;
+	ngx_chain_t  *cl;
+
+	/* link, buffer, and data share one allocation */
+	p = ngx_alloc(sizeof(ngx_chain_t) + sizeof(ngx_buf_t) + LWS_RESPONSE_CHUNK_SIZE, log);
+	if (!p) {
+		return NULL;
+	}
+	cl = (ngx_chain_t *)p;
+	b = (ngx_buf_t *)(p + sizeof(ngx_chain_t));
+	ngx_memzero(b, sizeof(ngx_buf_t));
+	b->start = p + sizeof(ngx_chain_t) + sizeof(ngx_buf_t);
+	b->pos = b->start;
+	b->last = b->start;
+	b->end = b->start + LWS_RESPONSE_CHUNK_SIZE;
+	b->temporary = 1;
+	cl->buf = b;
+	cl->next = NULL;
+	return cl;
+}
+
+static int lws_spill_response_body (lws_request_ctx_t *ctx) {
+	u_char                    *name, *last;
+	size_t                     size;
+	ssize_t                    n;
+	ngx_fd_t                   fd;
+	ngx_buf_t                 *b;
+	ngx_chain_t               *cl, *next;
+	ngx_http_core_loc_conf_t  *clcf;
+
+	/* create an unlinked temp file in the client body temp path; this runs in the thread
+	   pool, so the file is created without the request pool */
+	clcf = ngx_http_get_module_loc_conf(ctx->r, ngx_http_core_module);
+	name = ngx_alloc(clcf->client_body_temp_path->name.len + sizeof("/lws-XXXXXX"), ctx->log);
+	if (!name) {
+		return -1;
+	}
+	last = ngx_cpymem(name, clcf->client_body_temp_path->name.data,
+			clcf->client_body_temp_path->name.len);
+	ngx_memcpy(last, "/lws-XXXXXX", sizeof("/lws-XXXXXX"));
+	fd = mkstemp((char *)name);
+	if (fd == -1) {
+		ngx_log_error(NGX_LOG_CRIT, ctx->log, errno,
+				"[LWS] failed to create response body temp file \"%s\"", name);
+		ngx_free(name);
+		return -1;
+	}
+	if (unlink((char *)name) != 0) {
+		ngx_log_error(NGX_LOG_ALERT, ctx->log, errno,
+				"[LWS] failed to unlink response body temp file \"%s\"", name);
+	}
+
+	/* copy chunks to the temp file */
+	for (cl = ctx->response_cl; cl; cl = cl->next) {
+		b = cl->buf;
+		for (size = b->last - b->pos; size > 0; size -= n) {
+			n = write(fd, b->last - size, size);
+			if (n == -1) {
+				if (errno == EINTR) {
+					n = 0;
+					continue;
+				}
+				ngx_log_error(NGX_LOG_CRIT, ctx->log, errno,
+						"[LWS] failed to write response body temp file \"%s\"", name);
+				(void)ngx_close_file(fd);
+				ngx_free(name);
+				return -1;
+			}
+		}
+	}
+
+	/* switch to the temp file */
+	for (cl = ctx->response_cl; cl; cl = next) {
+		next = cl->next;
+		ngx_free(cl);
+	}
+	ctx->response_cl = NULL;
+	ctx->response_last = NULL;
+	ctx->response_file.fd = fd;
+	ctx->response_file.name.data = name;
+	ctx->response_file.name.len = ngx_strlen(name);
+	ctx->response_file.log = ctx->log;
+	return 0;
+}
+
+static ngx_int_t lws_open_request_stream (lws_request_ctx_t *ctx) {
+	ngx_fd_t             fds[2];
 	ngx_log_t           *log;
-	lws_main_conf_t     *lmcf;
-	ngx_thread_task_t   *task;
 	ngx_http_request_t  *r;
 
-	/* acquire state */
+	/* Lua reads the body from a blocking pipe that the event loop fills as the client sends
+	   the body; the pipe buffer provides backpressure */
 	r = ctx->r;
-	if (lws_acquire_state(ctx) != 0) {
-		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-		return;
+	log = ctx->log;
+	if (pipe(fds) != 0) {
+		ngx_log_error(NGX_LOG_CRIT, log, errno, "[LWS] failed to create request streaming pipe");
+		return NGX_ERROR;
+	}
+	ctx->request_pipe = fds[0];
+	ctx->request_body = fopencookie(ctx, "rb", lws_request_stream_functions);
+	if (!ctx->request_body) {
+		ngx_log_error(NGX_LOG_ERR, log, errno, "[LWS] failed to open request body stream");
+		close(fds[0]);
+		close(fds[1]);
+		return NGX_ERROR;
+	}
+	if (ngx_nonblocking(fds[1]) == -1) {
+		ngx_log_error(NGX_LOG_CRIT, log, errno,
+				"[LWS] failed to make request streaming pipe nonblocking");
+		close(fds[1]);
+		return NGX_ERROR;
 	}
+	ctx->request_conn = ngx_get_connection(fds[1], log);
+	if (!ctx->request_conn) {
+		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to get request streaming connection");
+		close(fds[1]);
+		return NGX_ERROR;
+	}
+	ctx->request_conn->data = ctx;
+	ctx->request_conn->write->log = log;
+	ctx->request_conn->write->handler = lws_request_stream_write_handler;
+	r->read_event_handler = lws_request_stream_handler;
+	ctx->request_stream = 1;
 
-	/* setup task */
-	log = r->connection->log;
-	task = ngx_thread_task_alloc(r->pool, sizeof(lws_request_ctx_t *));
-	if (!task) {
-		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate thread task");
-		lws_release_state(ctx);
-		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-		return;
+	/* pass the body data received so far */
+	switch (lws_pump_request_body(ctx)) {
+	case NGX_OK:
+	case NGX_AGAIN:
+		return NGX_OK;
+
+	default:
+		return NGX_ERROR;
+	}
+}
+
+static ngx_int_t lws_pump_request_body (lws_request_ctx_t *ctx) {
+	ssize_t              n;
+	ngx_buf_t           *b;
+	ngx_int_t            rc;
+	ngx_connection_t    *conn;
+	ngx_http_request_t  *r;
+
+	r = ctx->r;
+	conn = ctx->request_conn;
+	if (!conn) {
+		return NGX_OK;
+	}
+	for ( ;; ) {
+		/* take the body data received */
+		if (!ctx->request_out) {
+			ctx->request_out = r->request_body->bufs;
+			r->request_body->bufs = NULL;
+		}
+
+		/* write to pipe; consumed buffers are recycled by NGINX */
+		while (ctx->request_out) {
+			b = ctx->request_out->buf;
+			if (b->pos < b->last) {
+				do {
+					n = write(conn->fd, b->pos, b->last - b->pos);
+				} while (n == -1 && errno == EINTR);
+				if (n == -1) {
+					if (errno == EAGAIN) {
+						/* Lua is behind; the client is not to blame for the wait */
+						if (r->connection->read->timer_set) {
+							ngx_del_timer(r->connection->read);
+						}
+						if (ngx_handle_write_event(conn->write, 0) != NGX_OK) {
+							ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+									"[LWS] failed to add request streaming event");
+							rc = NGX_ERROR;
+							goto error;
+						}
+						return NGX_AGAIN;
+					}
+					ngx_log_error(NGX_LOG_INFO, ctx->log, errno,
+							"[LWS] failed to write to request streaming pipe");
+					rc = NGX_ERROR;
+					goto error;
+				}
+				b->pos += n;
+				continue;
+			}
+			ctx->request_out = ctx->request_out->next;
+		}
+
+		/* read more */
+		if (!r->reading_body) {
+			break;
+		}
+		rc = ngx_http_read_unbuffered_request_body(r);
+		if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+			goto error;
+		}
+		if (rc == NGX_AGAIN && !r->request_body->bufs) {
+			return NGX_AGAIN;
+		}
 	}
-	*(lws_request_ctx_t **)task->ctx = ctx;
-	task->handler = lws_thread_handler;
-	task->event.handler = lws_finalization_handler;
-	task->event.data = ctx;
 
-	/* post task */
-	lmcf = ngx_http_get_module_main_conf(r, lws_module);
-	if (ngx_thread_task_post(lmcf->thread_pool, task) != NGX_OK) {
-		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to post thread task");
-		lws_release_state(ctx);
-		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-		return;
+	/* signal EOF */
+	ngx_close_connection(conn);
+	ctx->request_conn = NULL;
+	r->read_event_handler = ngx_http_block_reading;
+	return NGX_OK;
+
+	/* abort; Lua fails reading the body, and a queued request is finalized */
+	error:
+	ctx->request_body_rc = rc;
+	ngx_close_connection(conn);
+	ctx->request_conn = NULL;
+	ctx->request_out = NULL;
+	r->read_event_handler = ngx_http_block_reading;
+	if (ctx->in_queue) {
+		lws_cleanup_queued_request(ctx);
+		ngx_http_finalize_request(r, rc);
 	}
+	return rc;
 }
 
-static void lws_thread_handler (void *data, ngx_log_t *log) {
-	lws_request_ctx_t  *ctx;
-
-	ctx = *(lws_request_ctx_t **)data;
-	ctx->rc = lws_run_state(ctx);
+static void lws_request_stream_handler (ngx_http_request_t *r) {
+	(void)lws_pump_request_body(ngx_http_get_module_ctx(r, lws_module));
 }
 
-static ssize_t lws_read_handler (void *cookie, char *buf, size_t size) {
-	size_t              count;
-	ngx_buf_t          *b;
-	lws_request_ctx_t  *ctx;
-
-	/* done? */
-	ctx = cookie;
-	if (!ctx->cl) {
-		return 0;
-	}
+static void lws_request_stream_write_handler (ngx_event_t *ev) {
+	ngx_connection_t  *conn;
 
-	/* read */
-	b = ctx->cl->buf;
-	count = b->last - b->pos;
-	if (count > size) {
-		count = size;
-	}
-	ngx_memcpy(buf, b->pos, count);
-	b->pos += count;
-	if (b->pos == b->last) {
-		ctx->cl = ctx->cl->next;
-	}
-	return count;
+	conn = ev->data;
+	(void)lws_pump_request_body(conn->data);
 }
 
 static void lws_stream_handler (ngx_event_t *ev) {
@@ -1129,24 +2292,33 @@ static void lws_finalization_handler (ngx_event_t *ev) {
 	ngx_str_t            name;
 	ngx_chain_t          out;
 	lws_loc_conf_t      *llcf;
+	lws_main_conf_t     *lmcf;
 	lws_request_ctx_t   *ctx;
 	ngx_http_request_t  *r;
 
 	/* get request */
 	ctx = ev->data;
+	r = ctx->r;
+	lmcf = ngx_http_get_module_main_conf(r, lws_module);
 
 	/* release state */
+	if (lmcf->executor) {
+		ctx->state->thread = ctx->task->id;
+	}
 	lws_release_state(ctx);
 
-	/* check for queued requests */
-	r = ctx->r;
-	llcf = ngx_http_get_module_loc_conf(r, lws_module);
-	if (!ngx_queue_empty(&llcf->requests) && !llcf->qev.timer_set) {
-		ngx_add_timer(&llcf->qev, 0);
+	/* adapt limit, check for queued requests */
+	llcf = ctx->llcf->pool;
+	if (ctx->latency) {
+		lws_adapt_states(llcf, ctx->latency);
 	}
+	lws_trigger_queues(lmcf, llcf);
 
-	/* finalize streaming response */
+	/* finalize streaming response; a failed compression aborts it */
 	log = r->connection->log;
+	if (ctx->compression_rc != NGX_OK && ctx->streaming_rc == NGX_OK) {
+		ctx->streaming_rc = NGX_ERROR;
+	}
 	if (ctx->streaming_pipe[1] != -1) {
 		/* signal EOF after queued streaming data */
 		if (close(ctx->streaming_pipe[1]) != 0) {
@@ -1169,6 +2341,20 @@ static void lws_finalization_handler (ngx_event_t *ev) {
 			ctx->streaming_pipe[0] = -1;
 		}
 	}
+
+	/* release coalesced requests unless the response is buffered; decided after inspecting
+	   streaming, as unused streaming falls back to a buffered response */
+	if (ctx->streaming_conn || ctx->streaming_rc != NGX_OK || r->header_sent || ctx->rc != 0
+			|| ctx->redirect.len || ctx->sendfile.len
+			|| ctx->response_file.fd != NGX_INVALID_FILE || ctx->request_body_rc != NGX_OK) {
+		lws_complete_coalesced_requests(ctx, 0);
+	}
+
+	/* request body failed while streaming? the response of Lua is based on a partial body */
+	if (ctx->request_body_rc != NGX_OK) {
+		ngx_http_finalize_request(r, ctx->request_body_rc);
+		return;
+	}
 	if (r->header_sent || ctx->streaming_conn || ctx->streaming_rc != NGX_OK) {
 		/* streaming finalization selected -> handle committed, pending, or failed response */
 		if (ctx->rc < 0) {
@@ -1221,6 +2407,12 @@ static void lws_finalization_handler (ngx_event_t *ev) {
 		return;
 	}
 
+	/* file response? */
+	if (ctx->sendfile.len) {
+		lws_send_file(ctx);
+		return;
+	}
+
 	/* send header */
 	r->headers_out.status = ctx->status;
 	r->disable_not_modified = 1;
@@ -1228,7 +2420,13 @@ static void lws_finalization_handler (ngx_event_t *ev) {
 		ngx_log_error(NGX_LOG_CRIT, log, errno, "[LWS] failed to flush response body");
 		return ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
 	}
-	if (ctx->response_body_str.len > 0) {
+	if (ctx->cache_ttl > 0 && ctx->cache_key.len && ctx->response_len > 0
+			&& ctx->response_file.fd == NGX_INVALID_FILE && ctx->status >= NGX_HTTP_OK
+			&& ctx->status != NGX_HTTP_NO_CONTENT && ctx->status != NGX_HTTP_NOT_MODIFIED) {
+		lws_cache_response(ctx);
+	}
+	lws_complete_coalesced_requests(ctx, 1);
+	if (ctx->response_len > 0) {
 		if (r == r->main && (r->method == NGX_HTTP_HEAD
 				|| r->headers_out.status == NGX_HTTP_NO_CONTENT
 				|| r->headers_out.status == NGX_HTTP_NOT_MODIFIED)) {
@@ -1236,7 +2434,7 @@ static void lws_finalization_handler (ngx_event_t *ev) {
 			ngx_log_error(NGX_LOG_WARN, log, 0, "[LWS] ignoring response body");
 			r->header_only = 1;
 		} else {
-			r->headers_out.content_length_n = ctx->response_body_str.len;
+			r->headers_out.content_length_n = ctx->response_len;
 		}
 	} else {
 		if (r == r->main && (r->method != NGX_HTTP_HEAD
@@ -1255,159 +2453,307 @@ static void lws_finalization_handler (ngx_event_t *ev) {
 		return;
 	}
 
-	/* send body */
-	b = ngx_calloc_buf(r->pool);
-	if (!b) {
-		ngx_http_finalize_request(r, rc);
-		return;
+	/* send body; the chunks or temp file are passed as is and remain owned by the request
+	   context */
+	if (ctx->response_file.fd != NGX_INVALID_FILE && ctx->response_len > 0) {
+		b = ngx_calloc_buf(r->pool);
+		if (!b) {
+			ngx_http_finalize_request(r, NGX_ERROR);
+			return;
+		}
+		b->file = &ctx->response_file;
+		b->file_pos = 0;
+		b->file_last = ctx->response_len;
+		b->in_file = 1;
+		b->last_buf = (r == r->main) ? 1 : 0;
+		b->last_in_chain = 1;
+		out.buf = b;
+		out.next = NULL;
+		rc = ngx_http_output_filter(r, &out);
+	} else if (ctx->response_len > 0) {
+		b = ctx->response_last->buf;
+		b->last_buf = (r == r->main) ? 1 : 0;
+		b->last_in_chain = 1;
+		rc = ngx_http_output_filter(r, ctx->response_cl);
+	} else {
+		b = ngx_calloc_buf(r->pool);
+		if (!b) {
+			ngx_http_finalize_request(r, NGX_ERROR);
+			return;
+		}
+		b->last_buf = (r == r->main) ? 1 : 0;
+		b->last_in_chain = 1;
+		out.buf = b;
+		out.next = NULL;
+		rc = ngx_http_output_filter(r, &out);
 	}
-	b->start = ctx->response_body_str.data;
-	b->pos = b->start;
-	b->end = ctx->response_body_str.data + ctx->response_body_str.len;
-	b->last = b->end;
-	b->temporary = 1;
-	b->last_buf = (r == r->main) ? 1 : 0;
-	b->last_in_chain = 1;
-	out.buf = b;
-	out.next = NULL;
-	rc = ngx_http_output_filter(r, &out);
 	ngx_http_finalize_request(r, rc);
 }
 
 static ngx_int_t lws_set_response_header (lws_request_ctx_t *ctx) {
-	int                  expires, unfold;
-	u_char              *vattr, *vstart, *vend, *vpos;
-	ngx_str_t           *key, *value;
-	ngx_table_elt_t     *h;
-	ngx_http_request_t  *r;
+	ngx_str_t  *key, *value;
 
 	/* set headers */
-	r = ctx->r;
 	key = NULL;
 	while (lws_table_next(ctx->response_headers, key, &key, (void**)&value) == 0) {
-		#define lws_is_header(literal)  ngx_strncasecmp(key->data, (u_char *)literal,  \
-				 sizeof(literal) - 1) == 0
-		if (key->len == 12 && lws_is_header("Content-Type")) {
-			r->headers_out.content_type = *value;
-			r->headers_out.content_type_len = value->len;
-			continue;
-		} else if (key->len == 14 && lws_is_header("Content-Length")) {
-			continue;  /* content length is handled separately before */
-		} else if (key->len == 17 && lws_is_header("Transfer-Encoding")) {
-			continue;  /* transfer encoding is handled by NGINX */
-		}
-		h = ngx_list_push(&r->headers_out.headers);
-		if (!h) {
+		if (lws_push_response_header(ctx->r, key, value) != NGX_OK) {
 			return NGX_ERROR;
 		}
-		unfold = 0;
-		switch (key->len) {
-		case 4:
-			if (lws_is_header("Date")) {
-				r->headers_out.date = h;
-			} else if (lws_is_header("ETag")) {
-				r->headers_out.etag = h;
-			}
-			break;
+	}
+	return NGX_OK;
+}
 
-		case 6:
-			if (lws_is_header("Server")) {
-				r->headers_out.server = h;
-			}
-			break;
+ngx_int_t lws_push_response_header (ngx_http_request_t *r, ngx_str_t *key, ngx_str_t *value) {
+	int               expires, unfold;
+	u_char           *vattr, *vstart, *vend, *vpos;
+	ngx_table_elt_t  *h;
 
-		case 7:
-			if (lws_is_header("Refresh")) {
-				r->headers_out.refresh = h;
-			} else if (lws_is_header("Expires")) {
-				r->headers_out.expires = h;
-			}
-			break;
+	#define lws_is_header(literal)  ngx_strncasecmp(key->data, (u_char *)literal,  \
+			 sizeof(literal) - 1) == 0
+	if (key->len == 12 && lws_is_header("Content-Type")) {
+		r->headers_out.content_type = *value;
+		r->headers_out.content_type_len = value->len;
+		return NGX_OK;
+	} else if (key->len == 14 && lws_is_header("Content-Length")) {
+		return NGX_OK;  /* content length is handled separately before */
+	} else if (key->len == 17 && lws_is_header("Transfer-Encoding")) {
+		return NGX_OK;  /* transfer encoding is handled by NGINX */
+	}
+	h = ngx_list_push(&r->headers_out.headers);
+	if (!h) {
+		return NGX_ERROR;
+	}
+	unfold = 0;
+	switch (key->len) {
+	case 4:
+		if (lws_is_header("Date")) {
+			r->headers_out.date = h;
+		} else if (lws_is_header("ETag")) {
+			r->headers_out.etag = h;
+		}
+		break;
 
-		case 8:
-			if (lws_is_header("Location")) {
-				r->headers_out.location = h;
-			}
-			break;
+	case 6:
+		if (lws_is_header("Server")) {
+			r->headers_out.server = h;
+		}
+		break;
 
-		case 10:
-			if (lws_is_header("Set-Cookie")) {
-				unfold = 1;
-			}
-			break;
+	case 7:
+		if (lws_is_header("Refresh")) {
+			r->headers_out.refresh = h;
+		} else if (lws_is_header("Expires")) {
+			r->headers_out.expires = h;
+		}
+		break;
 
-		case 13:
-			if (lws_is_header("Last-Modified")) {
-				r->headers_out.last_modified = h;
-				r->headers_out.last_modified_time = ngx_parse_http_time(value->data, value->len);
-			} else if (lws_is_header("Content-Range")) {
-				r->headers_out.content_range = h;
-			} else if (lws_is_header("Accept-Ranges")) {
-				r->headers_out.accept_ranges = h;
-			}
-			break;
+	case 8:
+		if (lws_is_header("Location")) {
+			r->headers_out.location = h;
+		}
+		break;
 
-		case 16:
-			if (lws_is_header("Content-Encoding")) {
-				r->headers_out.content_encoding = h;
-			} else if (lws_is_header("WWW-Authenticate")) {
-				r->headers_out.www_authenticate = h;
-			}
-			break;
+	case 10:
+		if (lws_is_header("Set-Cookie")) {
+			unfold = 1;
 		}
-		#undef lws_is_header
-		if (!unfold) {
-			h->key = *key;
-			h->value = *value;
-			h->hash = 1;
-		} else {
-			vstart = value->data;
-			vend = value->data + value->len;
-			while (1) {
-				expires = 0;
-				vpos = vstart;
-				while (vpos < vend) {
-					if (*vpos == ';') {
-						vattr = vpos + 1;
-						while (vattr < vend && (*vattr == ' ' || *vattr == '\t')) {
-							vattr++;
-						}
-						expires = (size_t)(vend - vattr) >= sizeof("Expires=") - 1
-								&& ngx_strncasecmp(vattr, (u_char *)"Expires=", sizeof("Expires=")
-								- 1) == 0;
-					} else if (*vpos == ',') {
-						if (expires) {
-							expires = 0;
-						} else {
-							break;
-						}
+		break;
+
+	case 13:
+		if (lws_is_header("Last-Modified")) {
+			r->headers_out.last_modified = h;
+			r->headers_out.last_modified_time = ngx_parse_http_time(value->data, value->len);
+		} else if (lws_is_header("Content-Range")) {
+			r->headers_out.content_range = h;
+		} else if (lws_is_header("Accept-Ranges")) {
+			r->headers_out.accept_ranges = h;
+		}
+		break;
+
+	case 16:
+		if (lws_is_header("Content-Encoding")) {
+			r->headers_out.content_encoding = h;
+		} else if (lws_is_header("WWW-Authenticate")) {
+			r->headers_out.www_authenticate = h;
+		}
+		break;
+	}
+	#undef lws_is_header
+	if (!unfold) {
+		h->key = *key;
+		h->value = *value;
+		h->hash = 1;
+	} else {
+		vstart = value->data;
+		vend = value->data + value->len;
+		while (1) {
+			expires = 0;
+			vpos = vstart;
+			while (vpos < vend) {
+				if (*vpos == ';') {
+					vattr = vpos + 1;
+					while (vattr < vend && (*vattr == ' ' || *vattr == '\t')) {
+						vattr++;
+					}
+					expires = (size_t)(vend - vattr) >= sizeof("Expires=") - 1
+							&& ngx_strncasecmp(vattr, (u_char *)"Expires=", sizeof("Expires=")
+							- 1) == 0;
+				} else if (*vpos == ',') {
+					if (expires) {
+						expires = 0;
+					} else {
+						break;
 					}
-					vpos++;
-				}
-				h->key = *key;
-				h->value.data = vstart;
-				h->value.len = vpos - vstart;
-				h->hash = 1;
-				if (vpos == vend) {
-					break;
-				}
-				vstart = vpos + 1;
-				while (vstart < vend && *vstart == ' ') {
-					vstart++;
-				}
-				if (vstart == vend) {
-					break;
-				}
-				h = ngx_list_push(&r->headers_out.headers);
-				if (!h) {
-					return NGX_ERROR;
 				}
+				vpos++;
+			}
+			h->key = *key;
+			h->value.data = vstart;
+			h->value.len = vpos - vstart;
+			h->hash = 1;
+			if (vpos == vend) {
+				break;
+			}
+			vstart = vpos + 1;
+			while (vstart < vend && *vstart == ' ') {
+				vstart++;
+			}
+			if (vstart == vend) {
+				break;
+			}
+			h = ngx_list_push(&r->headers_out.headers);
+			if (!h) {
+				return NGX_ERROR;
 			}
 		}
 	}
 	return NGX_OK;
 }
 
+static void lws_send_file (lws_request_ctx_t *ctx) {
+	off_t                      length;
+	ngx_int_t                  rc;
+	ngx_str_t                  path;
+	ngx_log_t                 *log;
+	ngx_buf_t                 *b;
+	ngx_uint_t                 level;
+	ngx_chain_t                out;
+	ngx_http_request_t        *r;
+	ngx_open_file_info_t       of;
+	ngx_http_core_loc_conf_t  *clcf;
+
+	/* resolve path relative to the prefix */
+	r = ctx->r;
+	log = r->connection->log;
+	path.data = ngx_pnalloc(r->pool, ctx->sendfile.len + 1);
+	if (!path.data) {
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+	path.len = ctx->sendfile.len;
+	ngx_memcpy(path.data, ctx->sendfile.data, path.len);
+	path.data[path.len] = '\0';
+	if (ngx_get_full_name(r->pool, (ngx_str_t *)&ngx_cycle->prefix, &path) != NGX_OK) {
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	/* open file */
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+	ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+	of.read_ahead = clcf->read_ahead;
+	of.directio = clcf->directio;
+	of.valid = clcf->open_file_cache_valid;
+	of.min_uses = clcf->open_file_cache_min_uses;
+	of.errors = clcf->open_file_cache_errors;
+	of.events = clcf->open_file_cache_events;
+	if (ngx_http_set_disable_symlinks(r, clcf, &path, &of) != NGX_OK) {
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+	if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool) != NGX_OK) {
+		switch (of.err) {
+		case NGX_ENOENT:
+		case NGX_ENOTDIR:
+		case NGX_ENAMETOOLONG:
+			level = NGX_LOG_ERR;
+			rc = NGX_HTTP_NOT_FOUND;
+			break;
+
+		case NGX_EACCES:
+			level = NGX_LOG_ERR;
+			rc = NGX_HTTP_FORBIDDEN;
+			break;
+
+		default:
+			level = NGX_LOG_CRIT;
+			rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+		ngx_log_error(level, log, of.err, "[LWS] failed to %s file \"%V\"",
+				of.failed ? of.failed : "open", &path);
+		lws_send_error_response(ctx, rc);
+		return;
+	}
+	if (!of.is_file) {
+		ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] \"%V\" is not a file", &path);
+		lws_send_error_response(ctx, NGX_HTTP_NOT_FOUND);
+		return;
+	}
+	if (ctx->sendfile_offset > of.size) {
+		ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] offset %O beyond size of file \"%V\"",
+				ctx->sendfile_offset, &path);
+		lws_send_error_response(ctx, NGX_HTTP_RANGE_NOT_SATISFIABLE);
+		return;
+	}
+	length = of.size - ctx->sendfile_offset;
+	if (ctx->sendfile_length != -1 && ctx->sendfile_length < length) {
+		length = ctx->sendfile_length;
+	}
+
+	/* send header */
+	if (ctx->response_len > 0) {
+		ngx_log_error(NGX_LOG_WARN, log, 0, "[LWS] ignoring response body");
+	}
+	r->headers_out.status = ctx->status;
+	r->headers_out.content_length_n = length;
+	r->disable_not_modified = 1;
+	rc = ngx_http_send_header(r);
+	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+		ngx_http_finalize_request(r, rc);
+		return;
+	}
+	if (length == 0) {
+		ngx_http_finalize_request(r, r == r->main ? ngx_http_send_special(r, NGX_HTTP_LAST)
+				: NGX_OK);
+		return;
+	}
+
+	/* send file; the descriptor is owned by the open file cache or the request pool */
+	b = ngx_calloc_buf(r->pool);
+	if (!b) {
+		ngx_http_finalize_request(r, NGX_ERROR);
+		return;
+	}
+	b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+	if (!b->file) {
+		ngx_http_finalize_request(r, NGX_ERROR);
+		return;
+	}
+	b->file->fd = of.fd;
+	b->file->name = path;
+	b->file->log = log;
+	b->file->directio = of.is_directio;
+	b->file_pos = ctx->sendfile_offset;
+	b->file_last = ctx->sendfile_offset + length;
+	b->in_file = 1;
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+	out.buf = b;
+	out.next = NULL;
+	rc = ngx_http_output_filter(r, &out);
+	ngx_http_finalize_request(r, rc);
+}
+
 static void lws_send_error_response (lws_request_ctx_t *ctx, ngx_int_t rc) {
 	lws_loc_conf_t      *llcf;
 	ngx_http_request_t  *r;
@@ -1632,10 +2978,126 @@ static void lws_send_html_error_response (lws_request_ctx_t *ctx, ngx_int_t rc)
 	ngx_http_finalize_request(r, rc);
 }
 
+int lws_load_request_headers (lws_request_ctx_t *ctx) {
+	ngx_str_t             *key;
+	ngx_uint_t             i;
+	lws_table_t           *t;
+	ngx_list_part_t       *part;
+	ngx_table_elt_t       *headers;
+	ngx_http_request_t    *r;
+	lws_request_header_t  *request_header, *merged;
+
+	/* create table; this runs in the thread pool, so values are allocated outside the
+	   request pool and freed by the table */
+	t = lws_table_create(32, ctx->log);
+	if (!t) {
+		ngx_log_error(NGX_LOG_CRIT, ctx->log, 0, "[LWS] failed to create request headers");
+		return -1;
+	}
+	lws_table_set_free(t, 1);
+	lws_table_set_ci(t, 1);
+
+	/* collect headers, counting repeated headers */
+	r = ctx->r;
+	for (part = &r->headers_in.headers.part; part; part = part->next) {
+		headers = part->elts;
+		for (i = 0; i < part->nelts; i++) {
+			request_header = lws_table_get(t, &headers[i].key);
+			if (!request_header) {
+				request_header = ngx_alloc(sizeof(lws_request_header_t), ctx->log);
+				if (!request_header) {
+					goto error;
+				}
+				request_header->value = headers[i].value;
+				request_header->last = NULL;
+				request_header->count = 1;
+				if (lws_table_set(t, &headers[i].key, &request_header->value) != 0) {
+					ngx_free(request_header);
+					goto error;
+				}
+			} else {
+				request_header->value.len += 2 + headers[i].value.len;
+				request_header->count++;
+			}
+		}
+	}
+
+	/* allocate repeated headers with room for their merged value */
+	key = NULL;
+	while (lws_table_next(t, key, &key, (void**)&request_header) == 0) {
+		if (request_header->count > 1) {
+			merged = ngx_alloc(sizeof(lws_request_header_t) + request_header->value.len,
+					ctx->log);
+			if (!merged) {
+				goto error;
+			}
+			merged->value.data = (u_char *)(merged + 1);
+			merged->value.len = request_header->value.len;
+			merged->last = NULL;
+			merged->count = request_header->count;
+			(void)lws_table_set(t, key, &merged->value);  /* replaces; frees previous */
+		}
+	}
+
+	/* merge repeated headers */
+	for (part = &r->headers_in.headers.part; part; part = part->next) {
+		headers = part->elts;
+		for (i = 0; i < part->nelts; i++) {
+			request_header = lws_table_get(t, &headers[i].key);
+			if (request_header->count == 1) {
+				continue;
+			}
+			if (request_header->last) {
+				request_header->last = lws_cpylit(request_header->last, ", ");
+			} else {
+				request_header->last = request_header->value.data;
+			}
+			request_header->last = ngx_cpymem(request_header->last, headers[i].value.data,
+					headers[i].value.len);
+		}
+	}
+	ctx->request_headers = t;
+	return 0;
+
+	error:
+	ngx_log_error(NGX_LOG_CRIT, ctx->log, 0, "[LWS] failed to allocate header");
+	lws_table_free(t);
+	return -1;
+}
+
+void lws_reset_response_body (lws_request_ctx_t *ctx) {
+	ngx_chain_t  *cl, *next;
+
+	/* truncate the temp file, if spilled */
+	ctx->response_len = 0;
+	if (ctx->response_file.fd != NGX_INVALID_FILE) {
+		if (ftruncate(ctx->response_file.fd, 0) != 0
+				|| lseek(ctx->response_file.fd, 0, SEEK_SET) == -1) {
+			ngx_log_error(NGX_LOG_CRIT, ctx->log, errno,
+					"[LWS] failed to truncate response body temp file");
+		}
+	}
+
+	/* keep the first chunk for reuse */
+	if (!ctx->response_cl) {
+		return;
+	}
+	for (cl = ctx->response_cl->next; cl; cl = next) {
+		next = cl->next;
+		ngx_free(cl);
+	}
+	ctx->response_cl->next = NULL;
+	ctx->response_cl->buf->last = ctx->response_cl->buf->pos;
+	ctx->response_last = ctx->response_cl;
+}
+
 static void lws_cleanup_request_ctx (void *data) {
+	ngx_chain_t        *cl, *next;
 	lws_request_ctx_t  *ctx;
 
 	ctx = data;
+	lws_cleanup_queued_request(ctx);
+	lws_complete_coalesced_requests(ctx, 0);
 	if (ctx->variables) {
 		lws_table_free(ctx->variables);
 	}
@@ -1645,13 +3107,27 @@ static void lws_cleanup_request_ctx (void *data) {
 	if (ctx->request_body) {
 		fclose(ctx->request_body);
 	}
+	if (ctx->request_conn) {
+		ngx_close_connection(ctx->request_conn);  /* closes the file descriptor */
+	}
 	if (ctx->response_headers) {
 		lws_table_free(ctx->response_headers);
 	}
 	if (ctx->response_body) {
 		fclose(ctx->response_body);
-		free(ctx->response_body_str.data);
 	}
+	for (cl = ctx->response_cl; cl; cl = next) {
+		next = cl->next;
+		ngx_free(cl);
+	}
+	lws_free_compression(ctx);
+	if (ctx->response_file.fd != NGX_INVALID_FILE) {
+		if (ngx_close_file(ctx->response_file.fd) == NGX_FILE_ERROR) {
+			ngx_log_error(NGX_LOG_ALERT, ctx->log, ngx_errno,
+					"[LWS] failed to close response body temp file");
+		}
+	}
+	ngx_free(ctx->response_file.name.data);
 	if (ctx->streaming_conn) {
 		ngx_close_connection(ctx->streaming_conn);  /* closes the file descriptor */
 	} else if (ctx->streaming_pipe[0] != -1) {
@@ -1662,5 +3138,6 @@ static void lws_cleanup_request_ctx (void *data) {
 	}
 	ngx_free(ctx->redirect.data);
 	ngx_free(ctx->redirect_args.data);
+	ngx_free(ctx->sendfile.data);
 	ngx_free(ctx->diagnostic.data);
 }
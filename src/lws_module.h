@@ -17,8 +17,14 @@
 #define LWS_THREAD_POOL_NAME_DEFAULT    "default"
 #define LWS_STAT_CACHE_CAP_DEFAULT      1024
 #define LWS_STAT_CACHE_TIMEOUT_DEFAULT  30
+#define LWS_CHUNK_CACHE_CAP_DEFAULT     1024
 #define LWS_STATES_MAX_DEFAULT          32
 #define LWS_REQUESTS_MAX_DEFAULT        256
+#define LWS_CODEL_INTERVAL_DEFAULT      100
+#define LWS_ADAPTIVE_TOLERANCE          2
+#define LWS_ADAPTIVE_WINDOW             1024
+#define LWS_RETRY_AFTER                 "1"
+#define LWS_RESPONSE_CHUNK_SIZE         16384
 #define lws_cpylit(p, lit)              ngx_cpymem(p, lit, sizeof(lit) - 1)
 
 
@@ -29,6 +35,10 @@ typedef struct lws_request_header_s lws_request_header_t;
 typedef struct lws_variable_s lws_variable_t;
 
 
+#include <lws_cache.h>
+#include <lws_coalesce.h>
+#include <lws_compress.h>
+#include <lws_executor.h>
 #include <lws_monitor.h>
 #include <lws_state.h>
 #include <lws_table.h>
@@ -37,9 +47,17 @@ typedef struct lws_variable_s lws_variable_t;
 typedef enum {
 	LWS_FS_UNKNOWN,
 	LWS_FS_FOUND,
-	LWS_FS_NOT_FOUND
+	LWS_FS_NOT_FOUND,
+	LWS_FS_ERROR
 } lws_file_status_e;
 
+typedef struct {
+	time_t  mtime;       /* modification time [s]; 0 = not found */
+	long    mtime_nsec;  /* modification time [ns] */
+	ino_t   ino;         /* inode number */
+	off_t   size;        /* size */
+} lws_file_version_t;
+
 typedef enum {
 	LWS_ER_JSON,
 	LWS_ER_HTML
@@ -48,39 +66,78 @@ typedef enum {
 struct lws_main_conf_s {
 	ngx_thread_pool_t  *thread_pool;         /* thread pool for async execution of Lua */
 	ngx_str_t           thread_pool_name;    /* name of thread pool */
+	ngx_uint_t          executor_threads;    /* executor threads; 0 = use thread pool */
+	ngx_uint_t          executor_queue_max;  /* executor run queue size per thread */
+	ngx_flag_t          executor_pin;        /* pin executor threads to CPUs */
+	lws_executor_t     *executor;            /* executor; per worker process */
 	lws_table_t        *stat_cache;          /* timed file stat cache to reduce syscalls */
 	size_t              stat_cache_cap;      /* cap of stat cache; 0 = disabled */
 	time_t              stat_cache_timeout;  /* timeout of stat cache */
+	lws_table_t        *chunk_cache;         /* compiled chunk cache shared by Lua states */
+	size_t              chunk_cache_cap;     /* cap of chunk cache; 0 = disabled */
+	ngx_thread_mutex_t  chunk_cache_mutex;   /* mutex protecting chunk cache */
+	ngx_thread_mutex_t  stat_cache_mutex;    /* mutex protecting stat cache */
 	ngx_shm_zone_t     *monitor_shm;         /* monitor shared memory zone */
 	ngx_slab_pool_t    *monitor_pool;        /* monitor slab allocator */
 	lws_monitor_t      *monitor;             /* monitor */
+	ngx_array_t         locations;           /* LWS location configurations */
 };
 
 struct lws_loc_conf_s {
-	ngx_http_complex_value_t  *main;       /* filename of main Lua chunk */
-	ngx_http_complex_value_t  *path_info;  /* path info */
+	ngx_http_complex_value_t  *main;          /* filename of main Lua chunk */
+	ngx_http_complex_value_t  *path_info;     /* path info */
+	ngx_http_complex_value_t  *cache_key;     /* response cache key */
+	ngx_shm_zone_t            *cache;         /* response cache zone */
+	ngx_http_complex_value_t  *coalesce_key;  /* request coalescing key */
 	ngx_str_t    init;                     /* filename of init Lua chunk (runs once) */
 	ngx_str_t    pre;                      /* filename of pre Lua chunk */
 	ngx_str_t    post;                     /* filename of post Lua chunk */
 	ngx_str_t    path;                     /* Lua path */
 	ngx_str_t    cpath;                    /* Lua C path */
+	ngx_str_t    pool_name;                /* name of shared Lua state pool */
+	size_t       states_min;               /* Lua states pre-warmed at worker start; 0 = none */
 	size_t       states_max;               /* maximum Lua states; 0 = unrestricted */
+	ngx_flag_t   states_adaptive;          /* adapt active Lua states to latency */
 	size_t       requests_max;             /* maximum queued requests; 0 = unrestricted */
+	ngx_msec_t   requests_wait_max;        /* maximum queue wait; 0 = unlimited */
+	ngx_msec_t   codel_target;             /* CoDel target queue wait; 0 = disabled */
+	ngx_msec_t   codel_interval;           /* CoDel interval */
 	size_t       state_memory_max;         /* maximum Lua state memory; 0 = unrestricted */
 	size_t       state_gc;                 /* Lua state explicit GC threshold; 0 = never */
 	ngx_int_t    state_requests_max;       /* maximum Lua state requests; 0 = unlimited */
 	ngx_msec_t   state_time_max;           /* maximum Lua state lifetime; 0 = unlimited */
 	ngx_msec_t   state_timeout;            /* Lua state idle timeout; 0 = unlimited */
+	ngx_int_t    state_jitter;             /* Lua state lifecycle jitter [%] */
+	ngx_msec_t   state_replace;            /* Lua state replacement lead time; 0 = off */
 	ngx_uint_t   error_response;           /* error response [json, html] */
 	ngx_flag_t   diagnostic;               /* include diagnostic w/ error response */
 	ngx_flag_t   streaming;                /* streaming enabled */
+	ngx_flag_t   request_streaming;        /* request body streaming enabled */
+	size_t       response_buffer;          /* in-memory response body limit; 0 = unlimited */
+	ngx_flag_t   compress;                 /* compress response bodies */
+	ngx_int_t    compress_level;           /* compression level */
+	ngx_flag_t   reload;                   /* reload changed Lua chunks */
 	ngx_flag_t   monitor;                  /* monitor enabled */
+	lws_table_t  *coalesce;                /* leading request contexts by coalescing key */
 	ngx_array_t  variables;                /* variables */
+	lws_loc_conf_t  *pool;                 /* Lua state pool owner; self if unshared */
 	ngx_uint_t   states_n;                 /* number of Lua states (active + inactive) */
 	ngx_queue_t  states;                   /* inactive Lua states */
+	ngx_uint_t   states_active;            /* number of Lua states running requests */
+	ngx_uint_t   states_limit;             /* adaptive limit of active Lua states */
+	ngx_uint_t   states_samples;           /* latency samples in round */
+	ngx_uint_t   latency_round_min;        /* minimum execution latency in round [us] */
+	ngx_uint_t   latency_baseline;         /* baseline execution latency [us] */
+	ngx_uint_t   latency_window_min;       /* minimum execution latency in window [us] */
+	ngx_uint_t   latency_window_n;         /* latency samples in window */
 	ngx_uint_t   requests_n;               /* number of queued requests */
 	ngx_queue_t  requests;                 /* queued requests */
 	ngx_event_t  qev;                      /* queue event */
+	ngx_event_t  dev;                      /* queue deadline event */
+	ngx_msec_t   codel_first_above;        /* CoDel time queue wait stays above target; 0 = not */
+	ngx_msec_t   codel_drop_next;          /* CoDel time of next drop */
+	ngx_uint_t   codel_count;              /* CoDel drops since dropping began */
+	ngx_uint_t   codel_dropping;           /* CoDel dropping state */
 };
 
 struct lws_request_header_s {
@@ -91,19 +148,32 @@ struct lws_request_header_s {
 
 struct lws_request_ctx_s {
 	ngx_queue_t          queue;              /* location configuration queue */
-	ngx_http_request_t  *r;                  /* NGINX HTTP request */
+	ngx_http_request_t  *r;                  /* NGINX HTTP request; NULL when pre-warming */
+	lws_loc_conf_t      *llcf;               /* location configuration */
+	ngx_log_t           *log;                /* log */
 	ngx_str_t            main;               /* filename of main Lua chunk */
 	ngx_str_t            path_info;          /* request path info */
 	lws_state_t         *state;              /* active Lua state */
+	ngx_thread_task_t   *task;               /* thread task */
 	lws_table_t         *variables;          /* request variables */
 	lws_table_t         *request_headers;    /* request headers */
 	FILE                *request_body;       /* HTTP request body stream */
 	ngx_chain_t         *cl;                 /* HTTP request body chain */
+	u_char              *cl_pos;             /* HTTP request body chain read position */
+	ngx_connection_t    *request_conn;       /* HTTP request body streaming connection */
+	ngx_chain_t         *request_out;        /* HTTP request body data pending for pipe */
+	ngx_fd_t             request_pipe;       /* HTTP request body streaming pipe, read end */
+	ngx_int_t            request_body_rc;    /* HTTP request body streaming code */
 	ngx_int_t            rc;                 /* NGINX response code */
 	ngx_int_t            status;             /* HTTP reponse status */
 	lws_table_t         *response_headers;   /* HTTP response headers */
 	FILE                *response_body;      /* HTTP response body stream */
-	ngx_str_t            response_body_str;  /* HTTP response body string */
+	ngx_chain_t         *response_cl;        /* HTTP response body chunks */
+	ngx_chain_t         *response_last;      /* last HTTP response body chunk */
+	size_t               response_len;       /* HTTP response body length */
+	ngx_file_t           response_file;      /* HTTP response body temp file, if spilled */
+	lws_compress_t      *compression;        /* HTTP response body compression */
+	ngx_int_t            compression_rc;     /* HTTP response body compression code */
 	ngx_fd_t             streaming_pipe[2];  /* HTTP response streaming pipe */
 	ngx_connection_t    *streaming_conn;     /* HTTP response streaming connection */
 	ngx_int_t            streaming_rc;       /* HTTP response streaming code */
@@ -111,7 +181,20 @@ struct lws_request_ctx_s {
 	ngx_chain_t         *streaming_busy;     /* busy HTTP response streaming buffers */
 	ngx_str_t            redirect;           /* NGINX internal redirect; @ prefix for name */
 	ngx_str_t            redirect_args;      /* NGINX internal redirect args */
+	ngx_str_t            sendfile;           /* file sent as HTTP response body */
+	ngx_str_t            cache_key;          /* HTTP response cache key; empty = uncached */
+	time_t               cache_ttl;          /* HTTP response cache TTL [s]; 0 = uncached */
+	ngx_str_t            coalesce_key;       /* request coalescing key; empty = not leading */
+	ngx_queue_t          followers;          /* coalesced requests awaiting the response */
+	off_t                sendfile_offset;    /* offset of file range */
+	off_t                sendfile_length;    /* length of file range; -1 = to end of file */
 	ngx_str_t            diagnostic;         /* diagnostic response */
+	ngx_msec_t           queued;             /* time queued */
+	ngx_uint_t           latency;            /* execution latency [us]; 0 = unmeasured */
+	unsigned             in_queue:1;         /* request is queued */
+	unsigned             request_stream:1;   /* request body is streaming */
+	unsigned             compress:1;         /* response body may be compressed */
+	unsigned             vary:1;             /* response may vary by Accept-Encoding */
 };
 
 struct lws_variable_s {
@@ -120,6 +203,18 @@ struct lws_variable_s {
 };
 
 
+lws_file_status_e lws_get_file_status(lws_main_conf_t *lmcf, ngx_str_t *filename,
+		lws_file_version_t *version, ngx_log_t *log);
+void lws_get_file_version(struct stat *sb, lws_file_version_t *version);
+ngx_int_t lws_warm_state(lws_main_conf_t *lmcf, lws_loc_conf_t *llcf, ngx_log_t *log);
+ngx_int_t lws_start_request(ngx_http_request_t *r, lws_loc_conf_t *llcf, ngx_str_t *cache_key,
+		ngx_str_t *coalesce_key);
+int lws_load_request_headers(lws_request_ctx_t *ctx);
+ngx_chain_t *lws_alloc_response_chunk(ngx_log_t *log);
+void lws_reset_response_body(lws_request_ctx_t *ctx);
+ngx_int_t lws_push_response_header(ngx_http_request_t *r, ngx_str_t *key, ngx_str_t *value);
+
+
 extern ngx_module_t lws_module;
 
 
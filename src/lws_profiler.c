@@ -214,7 +214,7 @@ int lws_start_profiler (lua_State *L) {
 
 	/* initialize profiler */
 	ctx = (void *)lua_topointer(L, 1);
-	p->log = ctx->r->connection->log;
+	p->log = ctx->log;
 	p->functions = lws_table_create(32, p->log);
 	if (!p->functions) {
 		return luaL_error(L, "failed to create profiler functions");
@@ -17,6 +17,13 @@
 #endif
 
 
+typedef struct {
+	ngx_queue_t         *states;  /* states to close */
+	ngx_thread_mutex_t   mutex;   /* mutex protecting states */
+	ngx_log_t           *log;     /* log */
+} lws_close_ctx_t;
+
+
 static inline int lws_getfield(lua_State *L, int index, const char *key);
 static inline int lws_getglobal(lua_State *L, const char *key);
 #if LUA_VERSION_NUM < 502
@@ -28,7 +35,14 @@ static void lws_set_path(lua_State *L, int index, const char *field);
 static int lws_init(lua_State *L);
 static void lws_set_state_timer(lws_state_t *state);
 static void lws_state_timer_handler(ngx_event_t *ev);
-static lws_state_t *lws_create_state(lws_request_ctx_t *ctx);
+static ngx_uint_t lws_jitter(lws_loc_conf_t *llcf, ngx_uint_t value);
+static void lws_replace_state(lws_state_t *state, ngx_log_t *log);
+static void lws_replace_timer_handler(ngx_event_t *ev);
+static int lws_init_state(lws_state_t *state, ngx_log_t *log);
+static void lws_retire_state(lws_state_t *state);
+static void lws_close_thread_handler(void *data, ngx_log_t *log);
+static void lws_close_finalization_handler(ngx_event_t *ev);
+static void *lws_close_thread(void *data);
 
 
 static inline int lws_getfield (lua_State *L, int index, const char *key) {
@@ -130,6 +144,10 @@ static void lws_set_path (lua_State *L, int index, const char *field) {
 }
 
 static int lws_init (lua_State *L) {
+#if LUA_VERSION_NUM >= 502
+	lws_main_conf_t  *lmcf;
+
+#endif
 	/* open standard libraries */
 	luaL_openlibs(L);
 
@@ -140,6 +158,22 @@ static int lws_init (lua_State *L) {
 	lws_set_path(L, 1, "path");
 	lws_set_path(L, 2, "cpath");
 
+#if LUA_VERSION_NUM >= 502
+	/* replace the Lua searcher with one using the chunk cache */
+	lmcf = lua_touserdata(L, 4);
+	if (lmcf->chunk_cache) {
+		if (lws_getglobal(L, LUA_LOADLIBNAME) != LUA_TTABLE
+				|| lws_getfield(L, -1, "searchers") != LUA_TTABLE) {
+			luaL_error(L, "failed to get searchers");
+		}
+		lua_pushlightuserdata(L, lmcf);
+		lua_pushvalue(L, -3);
+		lua_pushcclosure(L, lws_search_chunk, 2);
+		lua_rawseti(L, -2, 2);
+		lua_pop(L, 2);
+	}
+#endif
+
 	/* open profiler */
 	if (lua_toboolean(L, 3)) {
 		lua_pushcfunction(L, lws_open_profiler);
@@ -173,26 +207,84 @@ static void lws_state_timer_handler (ngx_event_t *ev) {
 	}
 }
 
-static lws_state_t *lws_create_state (lws_request_ctx_t *ctx) {
-	ngx_log_t        *log;
-	ngx_str_t         msg;
-	lws_state_t      *state;
-	lws_loc_conf_t   *llcf;
-	lws_main_conf_t  *lmcf;
+static ngx_uint_t lws_jitter (lws_loc_conf_t *llcf, ngx_uint_t value) {
+	ngx_uint_t  range;
+
+	/* shorten by a random amount up to the jitter percentage */
+	range = value * llcf->state_jitter / 100;
+	if (range == 0) {
+		return value;
+	}
+	value -= (ngx_uint_t)ngx_random() % (range + 1);
+	return value > 0 ? value : 1;
+}
+
+static void lws_replace_state (lws_state_t *state, ngx_log_t *log) {
+	/* create a fresh state ahead of retirement, so the pool does not run dry */
+	if (state->replaced || ngx_exiting || ngx_quit || ngx_terminate) {
+		return;
+	}
+	state->replaced = 1;
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "[LWS] replacing state L:%p", state->L);
+	(void)lws_warm_state(state->lmcf, state->llcf, log);
+}
+
+static void lws_replace_timer_handler (ngx_event_t *ev) {
+	lws_replace_state(ev->data, ev->log);
+}
+
+lws_state_t *lws_create_state (lws_main_conf_t *lmcf, lws_loc_conf_t *llcf, ngx_log_t *log) {
+	lws_state_t  *state;
 
 	/* create state */
-	log = ctx->r->connection->log;
 	state = ngx_calloc(sizeof(lws_state_t), log);
 	if (!state) {
 		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to allocate state");
 		return NULL;
 	}
-	lmcf = ngx_http_get_module_main_conf(ctx->r, lws_module);
 	state->lmcf = lmcf;
-	llcf = ngx_http_get_module_loc_conf(ctx->r, lws_module);
 	state->llcf = llcf;
 
+	/* set limits and timer; jitter staggers the retirement of states created together */
+	if (llcf->state_time_max) {
+		state->time_max = ngx_current_msec + lws_jitter(llcf, llcf->state_time_max);
+	} else {
+		state->time_max = NGX_TIMER_INFINITE;
+	}
+	if (llcf->state_requests_max > 0) {
+		state->requests_max = lws_jitter(llcf, llcf->state_requests_max);
+	}
+	state->timeout = NGX_TIMER_INFINITE;
+	state->tev.data = state;
+	state->tev.handler = lws_state_timer_handler;
+	state->tev.cancelable = 1;
+	state->tev.log = ngx_cycle->log;
+	lws_set_state_timer(state);
+
+	/* set replacement timer */
+	state->rev.data = state;
+	state->rev.handler = lws_replace_timer_handler;
+	state->rev.cancelable = 1;
+	state->rev.log = ngx_cycle->log;
+	if (llcf->state_replace > 0 && llcf->state_time_max > 0
+			&& state->time_max - ngx_current_msec > llcf->state_replace) {
+		ngx_add_timer(&state->rev, state->time_max - ngx_current_msec - llcf->state_replace);
+	}
+
+	/* done; the Lua state is created in the thread pool by lws_init_state */
+	llcf->states_n++;
+	if (lmcf->monitor) {
+		ngx_atomic_fetch_add(&lmcf->monitor->states_n, 1);
+	}
+	return state;
+}
+
+static int lws_init_state (lws_state_t *state, ngx_log_t *log) {
+	ngx_str_t        msg;
+	lws_loc_conf_t  *llcf;
+
 	/* create Lua state */
+	llcf = state->llcf;
 	if (llcf->state_memory_max > 0) {
 		state->memory_max = llcf->state_memory_max;
 #if LUA_VERSION_NUM >= 505
@@ -209,71 +301,172 @@ static lws_state_t *lws_create_state (lws_request_ctx_t *ctx) {
 	}
 	if (!state->L) {
 		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to create Lua state");
-		return NULL;
+		return -1;
 	}
 
 	/* initialize Lua state */
 	lua_pushcfunction(state->L, lws_init);
 	lua_pushlstring(state->L, (const char *)llcf->path.data, llcf->path.len);
 	lua_pushlstring(state->L, (const char *)llcf->cpath.data, llcf->cpath.len);
-	lua_pushboolean(state->L, lmcf->monitor != NULL);
-	if (lua_pcall(state->L, 3, 0, 0) != LUA_OK) {
+	lua_pushboolean(state->L, state->lmcf->monitor != NULL);
+	lua_pushlightuserdata(state->L, state->lmcf);
+	if (lua_pcall(state->L, 4, 0, 0) != LUA_OK) {
 		lws_get_msg(state->L, -1, &msg);
 		ngx_log_error(NGX_LOG_CRIT, log, 0, "[LWS] failed to initialize Lua state: %V",
 				&msg);
-		lws_close_state(state, log);
-		return NULL;
+		return -1;
 	}
 
 	/* push traceback */
 	lua_pushcfunction(state->L, lws_traceback);
 
-	/* set timer */
-	if (llcf->state_time_max) {
-		state->time_max = ngx_current_msec + llcf->state_time_max;
-	} else {
-		state->time_max = NGX_TIMER_INFINITE;
-	}
-	state->timeout = NGX_TIMER_INFINITE;
-	state->tev.data = state;
-	state->tev.handler = lws_state_timer_handler;
-	state->tev.cancelable = 1;
-	state->tev.log = ngx_cycle->log;
-	lws_set_state_timer(state);
-
 	/* done */
-	llcf->states_n++;
-	if (lmcf->monitor) {
-		ngx_atomic_fetch_add(&lmcf->monitor->states_n, 1);
-	}
 	ngx_log_error(NGX_LOG_INFO, log, 0, "[LWS] %s state created L:%p", LUA_VERSION, state->L);
-	return state;
+	return 0;
 }
 
-void lws_close_state (lws_state_t *state, ngx_log_t *log) {
+static void lws_retire_state (lws_state_t *state) {
 	lws_main_conf_t  *lmcf;
 
-	lua_close(state->L);
 	state->time_max = NGX_TIMER_INFINITE;
 	state->timeout = NGX_TIMER_INFINITE;
 	lws_set_state_timer(state);
+	if (state->rev.timer_set) {
+		ngx_del_timer(&state->rev);
+	}
 	state->llcf->states_n--;
 	lmcf = state->lmcf;
 	if (lmcf->monitor) {
 		ngx_atomic_fetch_add(&lmcf->monitor->states_n, -1);
 		ngx_atomic_fetch_add(&lmcf->monitor->memory_used, 0 - state->memory_monitor);
 	}
-	ngx_log_error(NGX_LOG_INFO, log, 0, "[LWS] %s state closed L:%p", LUA_VERSION, state->L);
+}
+
+static void lws_close_thread_handler (void *data, ngx_log_t *log) {
+	lws_state_t  *state;
+
+	state = data;
+	if (state->L) {
+		lua_close(state->L);
+	}
+}
+
+static void lws_close_finalization_handler (ngx_event_t *ev) {
+	lws_state_t  *state;
+
+	state = ev->data;
+	ngx_log_error(NGX_LOG_INFO, ev->log, 0, "[LWS] %s state closed L:%p", LUA_VERSION, state->L);
 	ngx_free(state);
 }
 
+void lws_close_state (lws_state_t *state, ngx_log_t *log) {
+	/* bookkeeping on the event loop */
+	lws_retire_state(state);
+
+	/* close the Lua state in the thread pool; large states take long to free */
+	state->task.ctx = state;
+	state->task.handler = lws_close_thread_handler;
+	state->task.event.handler = lws_close_finalization_handler;
+	state->task.event.data = state;
+	state->task.event.log = ngx_cycle->log;
+	if (ngx_thread_task_post(state->lmcf->thread_pool, &state->task) != NGX_OK) {
+		ngx_log_error(NGX_LOG_WARN, log, 0, "[LWS] failed to post close task; closing inline");
+		lws_close_thread_handler(state, log);
+		lws_close_finalization_handler(&state->task.event);
+	}
+}
+
+static void *lws_close_thread (void *data) {
+	ngx_queue_t      *q;
+	lws_state_t      *state;
+	lws_close_ctx_t  *cctx;
+
+	cctx = data;
+	for ( ;; ) {
+		/* get next state */
+		if (ngx_thread_mutex_lock(&cctx->mutex, cctx->log) != NGX_OK) {
+			break;
+		}
+		if (ngx_queue_empty(cctx->states)) {
+			(void)ngx_thread_mutex_unlock(&cctx->mutex, cctx->log);
+			break;
+		}
+		q = ngx_queue_head(cctx->states);
+		ngx_queue_remove(q);
+		(void)ngx_thread_mutex_unlock(&cctx->mutex, cctx->log);
+
+		/* close */
+		state = ngx_queue_data(q, lws_state_t, queue);
+		lws_close_thread_handler(state, cctx->log);
+		ngx_free(state);
+	}
+	return NULL;
+}
+
+void lws_close_states (ngx_queue_t *states, ngx_log_t *log) {
+	int               err;
+	ngx_uint_t        i, n, threads_n;
+	pthread_t        *threads;
+	ngx_queue_t      *q;
+	lws_state_t      *state;
+	lws_close_ctx_t   cctx;
+
+	/* bookkeeping */
+	n = 0;
+	for (q = ngx_queue_head(states); q != ngx_queue_sentinel(states); q = ngx_queue_next(q)) {
+		state = ngx_queue_data(q, lws_state_t, queue);
+		lws_retire_state(state);
+		n++;
+	}
+	if (n == 0) {
+		return;
+	}
+	ngx_log_error(NGX_LOG_INFO, log, 0, "[LWS] %s closing states n:%ui", LUA_VERSION, n);
+
+	/* the thread pools are gone at this point; close in parallel with temporary threads */
+	cctx.states = states;
+	cctx.log = log;
+	if (ngx_thread_mutex_create(&cctx.mutex, log) != NGX_OK) {
+		while (!ngx_queue_empty(states)) {
+			q = ngx_queue_head(states);
+			ngx_queue_remove(q);
+			state = ngx_queue_data(q, lws_state_t, queue);
+			lws_close_thread_handler(state, log);
+			ngx_free(state);
+		}
+		return;
+	}
+	threads_n = ngx_min(n, ngx_ncpu);
+	threads_n = threads_n > 1 ? threads_n - 1 : 0;
+	threads = threads_n > 0 ? ngx_alloc(threads_n * sizeof(pthread_t), log) : NULL;
+	if (!threads) {
+		threads_n = 0;
+	}
+	for (i = 0; i < threads_n; i++) {
+		err = pthread_create(&threads[i], NULL, lws_close_thread, &cctx);
+		if (err) {
+			ngx_log_error(NGX_LOG_WARN, log, err, "[LWS] failed to create close thread");
+			threads_n = i;
+			break;
+		}
+	}
+
+	/* participate, and join */
+	(void)lws_close_thread(&cctx);
+	for (i = 0; i < threads_n; i++) {
+		(void)pthread_join(threads[i], NULL);
+	}
+	ngx_free(threads);
+	(void)ngx_thread_mutex_destroy(&cctx.mutex, log);
+}
+
 int lws_acquire_state (lws_request_ctx_t *ctx) {
 	lws_state_t      *state;
 	ngx_queue_t      *q;
 	lws_loc_conf_t   *llcf;
 	lws_main_conf_t  *lmcf;
 
-	llcf = ngx_http_get_module_loc_conf(ctx->r, lws_module);
+	llcf = ctx->llcf->pool;
 	if (!ngx_queue_empty(&llcf->states)) {
 		q = ngx_queue_head(&llcf->states);
 		ngx_queue_remove(q);
@@ -283,7 +476,8 @@ int lws_acquire_state (lws_request_ctx_t *ctx) {
 			lws_set_state_timer(state);
 		}
 	} else {
-		state = lws_create_state(ctx);
+		lmcf = ngx_http_get_module_main_conf(ctx->r, lws_module);
+		state = lws_create_state(lmcf, llcf, ctx->log);
 		if (!state) {
 			return -1;
 		}
@@ -291,6 +485,7 @@ int lws_acquire_state (lws_request_ctx_t *ctx) {
 	lmcf = state->lmcf;
 	state->profiler = lmcf->monitor ? lmcf->monitor->profiler : 0;
 	state->in_use = 1;
+	llcf->states_active++;
 	ctx->state = state;
 	return 0;
 }
@@ -300,19 +495,28 @@ void lws_release_state (lws_request_ctx_t *ctx) {
 	lws_loc_conf_t   *llcf;
 	lws_main_conf_t  *lmcf;
 
-	/* count request */
+	/* count request, unless pre-warming */
 	state = ctx->state;
-	state->request_count++;
 	lmcf = state->lmcf;
-	if (lmcf->monitor) {
-		ngx_atomic_fetch_add(&lmcf->monitor->request_count, 1);
+	if (ctx->r) {
+		state->llcf->states_active--;
+		state->request_count++;
+		if (lmcf->monitor) {
+			ngx_atomic_fetch_add(&lmcf->monitor->request_count, 1);
+		}
 	}
 
-	/* close state? */
+	/* replace state ahead of its last request? */
 	llcf = state->llcf;
-	if (state->close || state->tev.timedout || (llcf->state_requests_max > 0
-			&& state->request_count >= llcf->state_requests_max)) {
-		lws_close_state(state, ctx->r->connection->log);
+	if (ctx->r && llcf->state_replace > 0 && state->requests_max > 0
+			&& state->request_count >= state->requests_max - 1) {
+		lws_replace_state(state, ctx->log);
+	}
+
+	/* close state? */
+	if (state->close || state->tev.timedout || (state->requests_max > 0
+			&& state->request_count >= state->requests_max)) {
+		lws_close_state(state, ctx->log);
 		return;
 	}
 
@@ -331,7 +535,7 @@ void lws_release_state (lws_request_ctx_t *ctx) {
 			state->memory_used = (size_t)lua_gc(state->L, LUA_GCCOUNT, 0) * 1024
 					+ lua_gc(state->L, LUA_GCCOUNTB, 0);
 		}
-		ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->r->connection->log, 0,
+		ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
 				"[LWS] GC L:%p before:%z after:%z", state->L, memory_used,
 				state->memory_used);
 	}
@@ -343,7 +547,7 @@ void lws_release_state (lws_request_ctx_t *ctx) {
 
 	/* update timeout */
 	if (llcf->state_timeout > 0) {
-		state->timeout = ngx_current_msec + llcf->state_timeout;
+		state->timeout = ngx_current_msec + lws_jitter(llcf, llcf->state_timeout);
 		lws_set_state_timer(state);
 	}
 
@@ -358,6 +562,12 @@ int lws_run_state (lws_request_ctx_t *ctx) {
 	ngx_log_t  *log;
 	ngx_str_t   msg;
 
+	/* create Lua state on first use */
+	if (!ctx->state->L && lws_init_state(ctx->state, ctx->log) != 0) {
+		ctx->state->close = 1;
+		return -1;
+	}
+
 	/* prepare stack */
 	L = ctx->state->L;
 	lua_pushcfunction(L, lws_run);
@@ -372,10 +582,10 @@ int lws_run_state (lws_request_ctx_t *ctx) {
 		ctx->state->close = 1;
 
 		/* log error */
-		log = ctx->r->connection->log;
+		log = ctx->log;
 		lws_get_msg(L, -1, &msg);
 		ngx_log_error(NGX_LOG_ERR, log, 0, "[LWS] %s error: %V", LUA_VERSION, &msg);
-		if (!ctx->state->llcf->diagnostic) {
+		if (!ctx->llcf->diagnostic) {
 			goto done;
 		}
 
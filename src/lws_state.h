@@ -11,6 +11,7 @@
 
 #include <ngx_config.h>
 #include <ngx_core.h>
+#include <ngx_thread_pool.h>
 #include <lua.h>
 
 
@@ -29,17 +30,24 @@ struct lws_state_s {
 	size_t            memory_max;      /* maximum memory */
 	size_t            memory_monitor;  /* memory accounted for in monitor */
 	ngx_int_t         request_count;   /* requests served */
+	ngx_int_t         requests_max;    /* maximum requests, jittered; 0 = unlimited */
+	ngx_uint_t        thread;          /* executor thread that last ran the state; 0 = none */
 	ngx_msec_t        time_max;        /* maximum lifetime */
 	ngx_msec_t        timeout;         /* idle timeout */
 	ngx_event_t       tev;             /* time event */
+	ngx_event_t       rev;             /* replacement event */
+	ngx_thread_task_t task;            /* close task */
 	unsigned          in_use:1;        /* state in use */
 	unsigned          init:1;          /* state initialized */
 	unsigned          close:1;         /* state is to be closed */
+	unsigned          replaced:1;      /* replacement state created */
 	unsigned          profiler:2;      /* profiler state; 0 = disabled, 1 = CPU, 2 = wall */
 };
 
 
+lws_state_t *lws_create_state(lws_main_conf_t *lmcf, lws_loc_conf_t *llcf, ngx_log_t *log);
 void lws_close_state(lws_state_t *state, ngx_log_t *log);
+void lws_close_states(ngx_queue_t *states, ngx_log_t *log);
 int lws_acquire_state(lws_request_ctx_t *ctx);
 void lws_release_state(lws_request_ctx_t *ctx);
 int lws_run_state(lws_request_ctx_t *ctx);
@@ -6,62 +6,69 @@
 
 
 #include <lws_table.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 
 #define LWS_TABLE_RANDOM_DEVICE  "/dev/urandom"
+#define LWS_TABLE_HASH_P0        0xa0761d6478bd642fULL  /* wyhash secrets */
+#define LWS_TABLE_HASH_P1        0xe7037ed1a0b428dbULL
+#define LWS_TABLE_HASH_P2        0x8ebc6af09c88c6e3ULL
+#define LWS_TABLE_EMPTY          0x80                   /* control byte of unused slot */
+#define LWS_TABLE_DELETED        0xfe                   /* control byte of deleted slot */
+#define LWS_TABLE_SMALL          8                      /* maximum entries of small table */
+
+/* control bytes are matched a group at a time; a match mask has a bit, or the high bit of a
+   byte, per matching slot */
+#if defined(__SSE2__)
+#define LWS_TABLE_GROUP          16
+#define LWS_TABLE_MASK_SHIFT     0
+typedef uint32_t lws_table_mask_t;
+#else
+#define LWS_TABLE_GROUP          8
+#define LWS_TABLE_MASK_SHIFT     3
+typedef uint64_t lws_table_mask_t;
+#endif
+#define lws_table_bit(m)         ((size_t)__builtin_ctzll(m) >> LWS_TABLE_MASK_SHIFT)
+#if defined(__SSE2__)
+#define lws_table_last_bits(m)   ((size_t)__builtin_clz(m) - 16)
+#else
+#define lws_table_last_bits(m)   ((size_t)__builtin_clzll(m) >> LWS_TABLE_MASK_SHIFT)
+#endif
 
 
 static ngx_uint_t lws_table_hash(lws_table_t *t, ngx_str_t *key);
-static size_t lws_table_size(lws_table_t *t, size_t size);
+static uint64_t lws_table_read8(u_char *p);
+static uint64_t lws_table_read4(u_char *p);
+static uint64_t lws_table_fold(uint64_t v);
+static void lws_table_mum(uint64_t *a, uint64_t *b);
+static uint64_t lws_table_mix(uint64_t a, uint64_t b);
+static lws_table_mask_t lws_table_match(u_char *ctrl, u_char h2);
+static lws_table_mask_t lws_table_match_empty(u_char *ctrl);
+static lws_table_mask_t lws_table_match_free(u_char *ctrl);
+static size_t lws_table_size(lws_table_t *t, size_t load);
 static size_t lws_table_load(lws_table_t *t, size_t alloc);
-static int lws_table_rehash(lws_table_t *t, size_t alloc);
-static lws_table_entry_t *lws_table_find(lws_table_t *t, ngx_str_t *key, ngx_uint_t hash);
-static lws_table_entry_t *lws_table_insert(lws_table_t *t, ngx_str_t *key, ngx_uint_t hash);
+static int lws_table_alloc(lws_table_t *t, size_t alloc);
+static int lws_table_rehash(lws_table_t *t);
+static void lws_table_drop_deleted(lws_table_t *t);
+static void lws_table_relink(lws_table_link_t *link);
+static lws_table_entry_t *lws_table_find(lws_table_t *t, ngx_str_t *key, ngx_uint_t *hash);
+static size_t lws_table_probe(lws_table_t *t, ngx_uint_t hash);
+static lws_table_entry_t *lws_table_insert(lws_table_t *t, ngx_uint_t hash);
+static void lws_table_set_ctrl(lws_table_t *t, size_t i, u_char c);
 static void lws_table_remove(lws_table_t *t, lws_table_entry_t *entry);
 
 
-#if SIZE_MAX > UINT32_MAX
-static ngx_uint_t lws_table_hash_seed = 14695981039346656037U;  /* FNV-1a offset basis */
-#else
-static ngx_uint_t lws_table_hash_seed = 2166136261U;  /* FNV-1a offset basis */
-#endif
-
-#if SIZE_MAX > UINT32_MAX
-static size_t lws_table_sizes[] = {
-	3, 5, 7, 11, 13, 17, 23, 29, 41, 53, 67, 89, 127, 157, 211, 277, 373, 499, 659, 877, 1171,
-	1553, 2081, 2767, 3691, 4909, 6547, 8731, 11633, 15511, 20681, 27581, 36749, 49003, 65353,
-	87107, 116141, 154871, 206477, 275299, 367069, 489427, 652559, 870083, 1160111, 1546799,
-	2062391, 2749847, 3666461, 4888619, 6518173, 8690917, 11587841, 15450437, 20600597,
-	27467443, 36623261, 48831017, 65107997, 86810681, 115747549, 154330079, 205773427,
-	274364561, 365819417, 487759219, 650345651, 867127501, 1156170011, 1541560037, 2055413317,
-	2740551103, 3654068141, 4872090871, 6496121063, 8661494753, 11548659701, 15398212901,
-	20530950533, 27374600677, 36499467569, 48665956771, 64887942367, 86517256433,
-	115356341911, 153808455923, 205077941191, 273437254897, 364583006561, 486110675443,
-	648147567293, 864196756231, 1152262341641, 1536349788871, 2048466385123, 2731288513529,
-	3641718017983, 4855624023953, 6474165365293, 8632220487029, 11509627316059,
-	15346169754719, 20461559672951, 27282079563967, 36376106085223, 48501474780299,
-	64668633040457, 86224844053847, 114966458738489, 153288611651291, 204384815535079,
-	272513087380099
-};
-static int lws_table_sizes_n = 112;
-#else
-static size_t lws_table_sizes[] = {
-	3, 5, 7, 11, 13, 17, 23, 29, 41, 53, 67, 89, 127, 157, 211, 277, 373, 499, 659, 877, 1171,
-	1553, 2081, 2767, 3691, 4909, 6547, 8731, 11633, 15511, 20681, 27581, 36749, 49003, 65353,
-	87107, 116141, 154871, 206477, 275299, 367069, 489427, 652559, 870083, 1160111, 1546799,
-	2062391, 2749847, 3666461, 4888619, 6518173, 8690917, 11587841, 15450437, 20600597,
-	27467443, 36623261, 48831017, 65107997, 86810681, 115747549, 154330079, 205773427,
-	274364561, 365819417, 487759219, 650345651, 867127501, 1156170011, 1541560037, 2055413317,
-	2740551103, 3654068141
-};
-static int lws_table_sizes_n = 73;
-#endif
+static uint64_t lws_table_hash_seed = LWS_TABLE_HASH_P2;  /* mixed; randomized per worker */
 
 
 int lws_table_init_hash (ngx_log_t *log) {
-	ssize_t     n;
-	ngx_fd_t    fd;
-	ngx_uint_t  seed;
+	ssize_t   n;
+	ngx_fd_t  fd;
+	uint64_t  seed;
 
 	fd = ngx_open_file((u_char *)LWS_TABLE_RANDOM_DEVICE, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 	if (fd == NGX_INVALID_FILE) {
@@ -80,27 +87,36 @@ int lws_table_init_hash (ngx_log_t *log) {
 				LWS_TABLE_RANDOM_DEVICE);
 		return -1;
 	}
-	lws_table_hash_seed = seed;
+	lws_table_hash_seed = seed ^ lws_table_mix(seed ^ LWS_TABLE_HASH_P0, LWS_TABLE_HASH_P1);
 	return 0;
 }
 
 lws_table_t *lws_table_create (size_t load, ngx_log_t *log) {
-	size_t        alloc;
 	lws_table_t  *t;
 
+	/* small tables are searched linearly, with entries and links in the same allocation, and
+	   switch to hashing when they outgrow it */
+	if (load <= LWS_TABLE_SMALL) {
+		t = ngx_calloc(sizeof(lws_table_t) + LWS_TABLE_SMALL * (sizeof(lws_table_entry_t)
+				+ sizeof(lws_table_link_t)), log);
+		if (!t) {
+			return NULL;
+		}
+		t->log = log;
+		t->entries = (lws_table_entry_t *)(t + 1);
+		t->links = (lws_table_link_t *)(t->entries + LWS_TABLE_SMALL);
+		t->load = LWS_TABLE_SMALL;
+		t->small = 1;
+		ngx_queue_init(&t->order);
+		return t;
+	}
+
 	t = ngx_calloc(sizeof(lws_table_t), log);
 	if (!t) {
 		return NULL;
 	}
 	t->log = log;
-	alloc = load + (load < lws_table_sizes[lws_table_sizes_n - 1] ? load / 7 + 3 : 0);
-	if ((t->alloc = lws_table_size(t, alloc)) == (size_t)-1) {
-		ngx_free(t);
-		return NULL;
-	}
-	t->load = lws_table_load(t, t->alloc);  /* t->load >= load */
-	t->entries = ngx_calloc(t->alloc * sizeof(lws_table_entry_t), t->log);
-	if (!t->entries) {
+	if (lws_table_alloc(t, lws_table_size(t, load)) != 0) {  /* t->load >= load */
 		ngx_free(t);
 		return NULL;
 	}
@@ -109,35 +125,40 @@ lws_table_t *lws_table_create (size_t load, ngx_log_t *log) {
 }
 
 void lws_table_free (lws_table_t *t) {
-	ngx_queue_t        *q;
-	lws_table_entry_t  *entry;
+	ngx_queue_t       *q;
+	lws_table_link_t  *link;
 
 	if (t->dup || t->free) {
 		while (!ngx_queue_empty(&t->order)) {
 			q = ngx_queue_last(&t->order);
-			entry = ngx_queue_data(q, lws_table_entry_t, order);
-			lws_table_remove(t, entry);
+			link = ngx_queue_data(q, lws_table_link_t, order);
+			lws_table_remove(t, &t->entries[link - t->links]);
 		}
 	}
-	ngx_free(t->entries);
+	if (!t->small) {
+		ngx_free(t->entries);
+	}
 	ngx_free(t);
 }
 
 void lws_table_clear (lws_table_t *t) {
-	ngx_queue_t        *q;
-	lws_table_entry_t  *entry;
+	ngx_queue_t       *q;
+	lws_table_link_t  *link;
 
 	if (t->dup || t->free) {
 		while (!ngx_queue_empty(&t->order)) {
 			q = ngx_queue_last(&t->order);
-			entry = ngx_queue_data(q, lws_table_entry_t, order);
-			lws_table_remove(t, entry);
+			link = ngx_queue_data(q, lws_table_link_t, order);
+			lws_table_remove(t, &t->entries[link - t->links]);
 		}
 	} else {
 		ngx_queue_init(&t->order);
-		t->count = 0;
 	}
-	ngx_memzero(t->entries, t->alloc * sizeof(lws_table_entry_t));
+	t->count = 0;
+	if (!t->small) {
+		t->deleted = 0;
+		ngx_memset(t->ctrl, LWS_TABLE_EMPTY, t->alloc + LWS_TABLE_GROUP - 1);
+	}
 }
 
 int lws_table_set_dup (lws_table_t *t, int dup) {
@@ -184,39 +205,42 @@ int lws_table_set_cap (lws_table_t *t, size_t cap) {
 
 void *lws_table_get (lws_table_t *t, ngx_str_t *key) {
 	ngx_uint_t          hash;
+	lws_table_link_t   *link;
 	lws_table_entry_t  *entry;
 
-	hash = lws_table_hash(t, key);
-	entry = lws_table_find(t, key, hash);
+	entry = lws_table_find(t, key, &hash);
 	if (!entry) {
 		return NULL;
 	}
+	link = &t->links[entry - t->entries];
 	if (t->timed) {
-		if (entry->time + t->timeout <= time(NULL)) {
+		if (link->time + t->timeout <= time(NULL)) {
 			return NULL;
 		}
 	}
 	if (t->capped) {
-		ngx_queue_remove(&entry->order);
-		ngx_queue_insert_tail(&t->order, &entry->order);
+		ngx_queue_remove(&link->order);
+		ngx_queue_insert_tail(&t->order, &link->order);
 	}
 	return entry->value;
 }
 
 int lws_table_set (lws_table_t *t, ngx_str_t *key, void *value) {
-	ngx_uint_t          hash;
+	ngx_uint_t          hash, hashed;
 	ngx_queue_t        *q;
 	ngx_str_t           entry_key;
-	lws_table_entry_t  *entry, *evict;
+	lws_table_link_t   *link;
+	lws_table_entry_t  *entry;
 
-	hash = lws_table_hash(t, key);
-	entry = lws_table_find(t, key, hash);
+	hashed = !t->small;
+	entry = lws_table_find(t, key, &hash);
 	if (value) {
 		if (entry) {
 			/* update existing */
+			link = &t->links[entry - t->entries];
 			if (t->capped) {
-				ngx_queue_remove(&entry->order);
-				ngx_queue_insert_tail(&t->order, &entry->order);
+				ngx_queue_remove(&link->order);
+				ngx_queue_insert_tail(&t->order, &link->order);
 			}
 			if (t->free && value != entry->value) {
 				ngx_free(entry->value);
@@ -226,13 +250,13 @@ int lws_table_set (lws_table_t *t, ngx_str_t *key, void *value) {
 			/* evict as needed */
 			if (t->capped && t->count == t->cap) {
 				q = ngx_queue_head(&t->order);
-				evict = ngx_queue_data(q, lws_table_entry_t, order);
-				lws_table_remove(t, evict);
+				link = ngx_queue_data(q, lws_table_link_t, order);
+				lws_table_remove(t, &t->entries[link - t->links]);
 			}
 
 			/* rehash as needed */
-			if (t->count == t->load) {
-				if (lws_table_rehash(t, t->alloc + 1) != 0) {
+			if (t->count + t->deleted >= t->load) {
+				if (lws_table_rehash(t) != 0) {
 					return -1;
 				}
 			}
@@ -248,16 +272,24 @@ int lws_table_set (lws_table_t *t, ngx_str_t *key, void *value) {
 			} else {
 				entry_key = *key;
 			}
-			entry = lws_table_insert(t, key, hash);
+			if (t->small) {
+				entry = &t->entries[t->count];
+				entry->hash = 0;  /* unused */
+			} else {
+				if (!hashed) {
+					hash = lws_table_hash(t, key);  /* switched to hashing */
+				}
+				entry = lws_table_insert(t, hash);
+				entry->hash = hash;
+			}
 			entry->key = entry_key;
 			entry->value = value;
-			entry->hash = hash;
-			entry->state = LWS_TES_SET;
-			ngx_queue_insert_tail(&t->order, &entry->order);
+			link = &t->links[entry - t->entries];
+			ngx_queue_insert_tail(&t->order, &link->order);
 			t->count++;
 		}
 		if (t->timed) {
-			entry->time = time(NULL);
+			link->time = time(NULL);
 		}
 	} else {
 		/* remove */
@@ -271,16 +303,16 @@ int lws_table_set (lws_table_t *t, ngx_str_t *key, void *value) {
 int lws_table_next (lws_table_t *t, ngx_str_t *key, ngx_str_t **next, void **value) {
 	ngx_uint_t          hash;
 	ngx_queue_t        *q;
+	lws_table_link_t   *link;
 	lws_table_entry_t  *entry;
 
 	if (key) {
 		/* continuation */
-		hash = lws_table_hash(t, key);
-		entry = lws_table_find(t, key, hash);
+		entry = lws_table_find(t, key, &hash);
 		if (!entry) {
 			return -1;
 		}
-		q = ngx_queue_next(&entry->order);
+		q = ngx_queue_next(&t->links[entry - t->entries].order);
 	} else {
 		/* start */
 		q = ngx_queue_head(&t->order);
@@ -288,197 +320,445 @@ int lws_table_next (lws_table_t *t, ngx_str_t *key, ngx_str_t **next, void **val
 	if (q == ngx_queue_sentinel(&t->order)) {
 		return -1;
 	}
-	entry = ngx_queue_data(q, lws_table_entry_t, order);
+	link = ngx_queue_data(q, lws_table_link_t, order);
+	entry = &t->entries[link - t->links];
 	*next = &entry->key;
 	*value = entry->value;
 	return 0;
 }
 
 static ngx_uint_t lws_table_hash (lws_table_t *t, ngx_str_t *key) {
-	u_char     *p;
-	ngx_uint_t  hash;
-
-	/* FNV-1a; source: http://www.isthe.com/chongo/tech/comp/fnv/index.html#FNV-1a */
-	#if SIZE_MAX > UINT32_MAX
-	#define _LWS_TABLE_HASH_PRIME 1099511628211
-	#else
-	#define _LWS_TABLE_HASH_PRIME 16777619
-	#endif
-	hash = lws_table_hash_seed;
-	p = key->data + key->len;
-	if (t->ci) {
-		while (p > key->data) {
-			p--;
-			hash ^= ngx_tolower(*p);  /* no '--' due to macro multiple evaluation */
-			hash *= _LWS_TABLE_HASH_PRIME;
+	u_char    *p;
+	size_t     len, n;
+	uint64_t   seed, a, b;
+
+	/* wyhash, reading words rather than bytes and folding case per word; source:
+	   https://github.com/wangyi-fudan/wyhash */
+	p = key->data;
+	len = key->len;
+	seed = lws_table_hash_seed;
+	if (len <= 16) {
+		if (len >= 4) {
+			n = (len >> 3) << 2;
+			a = lws_table_read4(p) << 32 | lws_table_read4(p + n);
+			b = lws_table_read4(p + len - 4) << 32 | lws_table_read4(p + len - 4 - n);
+		} else if (len > 0) {
+			a = (uint64_t)p[0] << 16 | (uint64_t)p[len >> 1] << 8 | p[len - 1];
+			b = 0;
+		} else {
+			a = b = 0;
 		}
 	} else {
-		while (p > key->data) {
-			hash ^= *--p;
-			hash *= _LWS_TABLE_HASH_PRIME;
+		for (n = len; n > 16; n -= 16, p += 16) {
+			a = lws_table_read8(p);
+			b = lws_table_read8(p + 8);
+			if (t->ci) {
+				a = lws_table_fold(a);
+				b = lws_table_fold(b);
+			}
+			seed = lws_table_mix(a ^ LWS_TABLE_HASH_P1, b ^ seed);
 		}
+		a = lws_table_read8(p + n - 16);
+		b = lws_table_read8(p + n - 8);
+	}
+	if (t->ci) {
+		a = lws_table_fold(a);
+		b = lws_table_fold(b);
 	}
-	#undef _LWS_TABLE_HASH_PRIME
-	return hash;
+	a ^= LWS_TABLE_HASH_P1;
+	b ^= seed;
+	lws_table_mum(&a, &b);
+	return (ngx_uint_t)lws_table_mix(a ^ LWS_TABLE_HASH_P0 ^ len, b ^ LWS_TABLE_HASH_P1);
 }
 
-static size_t lws_table_size (lws_table_t *t, size_t size) {
-	int  lower, upper, mid;
+static uint64_t lws_table_read8 (u_char *p) {
+	uint64_t  v;
 
-	lower = 0;
-	upper = lws_table_sizes_n - 1;
-	while (lower <= upper) {
-		mid = (lower + upper) / 2;
-		if (lws_table_sizes[mid] < size) {
-			lower = mid + 1;
-		} else {
-			upper = mid - 1;
-		}
-	}
-	if (lower >= lws_table_sizes_n) {
-		ngx_log_error(NGX_LOG_ERR, t->log, 0, "[LWS] table size too large: %z", size);
-		return (size_t)-1;
+	ngx_memcpy(&v, p, sizeof(v));  /* unaligned */
+	return v;
+}
+
+static uint64_t lws_table_read4 (u_char *p) {
+	uint32_t  v;
+
+	ngx_memcpy(&v, p, sizeof(v));  /* unaligned */
+	return v;
+}
+
+static uint64_t lws_table_fold (uint64_t v) {
+	uint64_t  heptets, above_at, above_z;
+
+	/* lowercase ASCII letters in all bytes at once, matching ngx_tolower; bytes with the high
+	   bit set are left unchanged */
+	heptets = v & 0x7f7f7f7f7f7f7f7fULL;
+	above_at = heptets + 0x3f3f3f3f3f3f3f3fULL;  /* high bit set if >= 'A' */
+	above_z = heptets + 0x2525252525252525ULL;   /* high bit set if > 'Z' */
+	return v | (((above_at ^ above_z) & ~v & 0x8080808080808080ULL) >> 2);
+}
+
+static void lws_table_mum (uint64_t *a, uint64_t *b) {
+	#if defined(__SIZEOF_INT128__)
+	unsigned __int128  r;
+
+	r = (unsigned __int128)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+	#else
+	uint64_t  ha, hb, la, lb, hi, rh, rm0, rm1, rl, t, lo, c;
+
+	ha = *a >> 32;
+	hb = *b >> 32;
+	la = (uint32_t)*a;
+	lb = (uint32_t)*b;
+	rh = ha * hb;
+	rm0 = ha * lb;
+	rm1 = hb * la;
+	rl = la * lb;
+	t = rl + (rm0 << 32);
+	c = t < rl;
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+	*a = lo;
+	*b = hi;
+	#endif
+}
+
+static uint64_t lws_table_mix (uint64_t a, uint64_t b) {
+	lws_table_mum(&a, &b);
+	return a ^ b;
+}
+
+static lws_table_mask_t lws_table_match (u_char *ctrl, u_char h2) {
+	#if defined(__SSE2__)
+	__m128i  group;
+
+	group = _mm_loadu_si128((__m128i *)ctrl);
+	return (lws_table_mask_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)h2)));
+	#elif defined(__ARM_NEON)
+	uint8x8_t  group;
+
+	group = vld1_u8(ctrl);
+	return vget_lane_u64(vreinterpret_u64_u8(vceq_u8(group, vdup_n_u8(h2))), 0)
+			& 0x8080808080808080ULL;
+	#else
+	uint64_t  group, x;
+
+	/* may report false positives after a true match, which the key comparison rejects */
+	ngx_memcpy(&group, ctrl, sizeof(group));
+	#if !(NGX_HAVE_LITTLE_ENDIAN)
+	group = __builtin_bswap64(group);
+	#endif
+	x = group ^ (0x0101010101010101ULL * h2);
+	return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+	#endif
+}
+
+static lws_table_mask_t lws_table_match_empty (u_char *ctrl) {
+	#if defined(__SSE2__)
+	__m128i  group;
+
+	group = _mm_loadu_si128((__m128i *)ctrl);
+	return (lws_table_mask_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group,
+			_mm_set1_epi8((char)LWS_TABLE_EMPTY)));
+	#elif defined(__ARM_NEON)
+	uint8x8_t  group;
+
+	group = vld1_u8(ctrl);
+	return vget_lane_u64(vreinterpret_u64_u8(vceq_u8(group, vdup_n_u8(LWS_TABLE_EMPTY))), 0)
+			& 0x8080808080808080ULL;
+	#else
+	uint64_t  group;
+
+	/* empty has the high bit set and bit 1 clear; deleted has both set */
+	ngx_memcpy(&group, ctrl, sizeof(group));
+	#if !(NGX_HAVE_LITTLE_ENDIAN)
+	group = __builtin_bswap64(group);
+	#endif
+	return group & ~(group << 6) & 0x8080808080808080ULL;
+	#endif
+}
+
+static lws_table_mask_t lws_table_match_free (u_char *ctrl) {
+	#if defined(__SSE2__)
+	__m128i  group;
+
+	/* empty or deleted, i.e., the high bit is set */
+	group = _mm_loadu_si128((__m128i *)ctrl);
+	return (lws_table_mask_t)_mm_movemask_epi8(group);
+	#elif defined(__ARM_NEON)
+	uint8x8_t  group;
+
+	group = vld1_u8(ctrl);
+	return vget_lane_u64(vreinterpret_u64_u8(group), 0) & 0x8080808080808080ULL;
+	#else
+	uint64_t  group;
+
+	ngx_memcpy(&group, ctrl, sizeof(group));
+	#if !(NGX_HAVE_LITTLE_ENDIAN)
+	group = __builtin_bswap64(group);
+	#endif
+	return group & 0x8080808080808080ULL;
+	#endif
+}
+
+static size_t lws_table_size (lws_table_t *t, size_t load) {
+	size_t  alloc;
+
+	/* smallest power of two of at least a group that holds load entries */
+	alloc = LWS_TABLE_GROUP;
+	while (lws_table_load(t, alloc) < load && alloc <= SIZE_MAX >> 2) {
+		alloc <<= 1;
 	}
-	return lws_table_sizes[lower];
+	return alloc;
 }
 
 static size_t lws_table_load (lws_table_t *t, size_t alloc) {
-	return (alloc >> 1) + (alloc >> 2) + (alloc >> 3);  /* ~87.5 percent */
+	return alloc - (alloc >> 3);  /* 87.5 percent */
 }
 
-static int lws_table_rehash (lws_table_t *t, size_t alloc) {
-	size_t              alloc_new;
-	lws_table_entry_t  *entries, *entries_new, *entry, *entry_new;
-	ngx_queue_t        *q, *s;
+static int lws_table_alloc (lws_table_t *t, size_t alloc) {
+	u_char  *p;
 
-	/* allocate */
-	if ((alloc_new = lws_table_size(t, alloc)) == (size_t)-1) {
+	/* entries, links, and control bytes in one allocation */
+	if (alloc == 0 || alloc > (SIZE_MAX - LWS_TABLE_GROUP) / (sizeof(lws_table_entry_t)
+			+ sizeof(lws_table_link_t) + 1)) {
+		ngx_log_error(NGX_LOG_ERR, t->log, 0, "[LWS] table size too large: %z", alloc);
 		return -1;
 	}
-	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, t->log, 0, "[LWS] table rehash t:%p old:%z new:%z", t,
-			t->alloc, alloc_new);
-	entries_new = ngx_calloc(alloc_new * sizeof(lws_table_entry_t), t->log);
-	if (!entries_new) {
+	p = ngx_alloc(alloc * (sizeof(lws_table_entry_t) + sizeof(lws_table_link_t) + 1)
+			+ LWS_TABLE_GROUP - 1, t->log);
+	if (!p) {
 		return -1;
 	}
+	t->entries = (lws_table_entry_t *)p;
+	t->links = (lws_table_link_t *)(t->entries + alloc);
+	t->ctrl = (u_char *)(t->links + alloc);
+	ngx_memset(t->ctrl, LWS_TABLE_EMPTY, alloc + LWS_TABLE_GROUP - 1);
+	t->alloc = alloc;
+	t->load = lws_table_load(t, alloc);
+	t->count = 0;
+	t->deleted = 0;
+	return 0;
+}
+
+static int lws_table_rehash (lws_table_t *t) {
+	size_t              alloc, count;
+	ngx_uint_t          small, hash;
+	ngx_queue_t        *q, *s;
+	lws_table_link_t   *links, *link, *link_new;
+	lws_table_entry_t  *entries, *entry_new;
+
+	/* drop deleted slots in place unless more than half full with entries */
+	if (!t->small && t->count < t->load >> 1) {
+		ngx_log_debug3(NGX_LOG_DEBUG_HTTP, t->log, 0, "[LWS] table rehash t:%p count:%z "
+				"deleted:%z", t, t->count, t->deleted);
+		lws_table_drop_deleted(t);
+		return 0;
+	}
 
-	/* update table */
-	t->alloc = alloc_new;
-	t->load = lws_table_load(t, t->alloc);
+	/* grow; a small table switches to hashing */
+	alloc = t->small ? lws_table_size(t, t->load + 1) : t->alloc << 1;
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, t->log, 0, "[LWS] table rehash t:%p old:%z new:%z", t,
+			t->alloc, alloc);
 	entries = t->entries;
-	t->entries = entries_new;
-	q = ngx_queue_last(&t->order);
+	links = t->links;
+	count = t->count;
+	small = t->small;
+	if (lws_table_alloc(t, alloc) != 0) {
+		return -1;
+	}
+	t->small = 0;
+
+	/* reinsert in order */
+	q = ngx_queue_head(&t->order);
 	s = ngx_queue_sentinel(&t->order);
 	ngx_queue_init(&t->order);
-
-	/* reinsert */
 	while (q != s) {
-		entry = ngx_queue_data(q, lws_table_entry_t, order);
-		entry_new = lws_table_insert(t, &entry->key, entry->hash);
-		*entry_new = *entry;
-		ngx_queue_insert_head(&t->order, &entry_new->order);
-		q = ngx_queue_prev(q);
+		link = ngx_queue_data(q, lws_table_link_t, order);
+		q = ngx_queue_next(q);
+		hash = small ? lws_table_hash(t, &entries[link - links].key)
+				: entries[link - links].hash;
+		entry_new = lws_table_insert(t, hash);
+		*entry_new = entries[link - links];
+		entry_new->hash = hash;
+		link_new = &t->links[entry_new - t->entries];
+		link_new->time = link->time;
+		ngx_queue_insert_tail(&t->order, &link_new->order);
+	}
+	t->count = count;
+	if (!small) {
+		ngx_free(entries);
 	}
-	ngx_free(entries);
 	return 0;
 }
 
-static lws_table_entry_t *lws_table_find (lws_table_t *t, ngx_str_t *key, ngx_uint_t hash) {
-	size_t              r, h, q;
-	lws_table_entry_t  *entry;
+static void lws_table_drop_deleted (lws_table_t *t) {
+	size_t              mask, offset, i, j;
+	lws_table_link_t    link;
+	lws_table_entry_t  *entry, tmp;
 
-	/* Brent's method; source: https://maths-people.anu.edu.au/~brent/pd/rpb013.pdf */
-	r = h = hash % t->alloc;
-	q = hash % (t->alloc - 2) + 1;
-	entry = &t->entries[h];
-	while (entry->state != LWS_TES_UNUSED) {
-		if (entry->state == LWS_TES_SET && entry->hash == hash && entry->key.len == key->len
-				&& (t->ci ? ngx_strncasecmp(entry->key.data, key->data, key->len)
-				: ngx_strncmp(entry->key.data, key->data, key->len)) == 0) {
-			return entry;
+	/* mark deleted slots empty, and entries pending placement deleted */
+	for (i = 0; i < t->alloc; i++) {
+		t->ctrl[i] = t->ctrl[i] & 0x80 ? LWS_TABLE_EMPTY : LWS_TABLE_DELETED;
+	}
+	ngx_memcpy(t->ctrl + t->alloc, t->ctrl, LWS_TABLE_GROUP - 1);
+
+	/* place entries; an entry stays if its first free slot is in the same group of its probe
+	   sequence; source: https://abseil.io/about/design/swisstables */
+	mask = t->alloc - 1;
+	for (i = 0; i < t->alloc; i++) {
+		if (t->ctrl[i] != LWS_TABLE_DELETED) {
+			continue;
+		}
+		entry = &t->entries[i];
+		offset = (entry->hash >> 7) & mask;
+		j = lws_table_probe(t, entry->hash);
+		if (((j - offset) & mask) / LWS_TABLE_GROUP == ((i - offset) & mask) / LWS_TABLE_GROUP) {
+			lws_table_set_ctrl(t, i, entry->hash & 0x7f);
+			continue;
 		}
-		h = (h + q) % t->alloc;
-		if (h == r) {
-			break;
+		if (t->ctrl[j] == LWS_TABLE_EMPTY) {
+			/* move to the empty slot */
+			lws_table_set_ctrl(t, j, entry->hash & 0x7f);
+			t->entries[j] = *entry;
+			t->links[j] = t->links[i];
+			lws_table_relink(&t->links[j]);
+			lws_table_set_ctrl(t, i, LWS_TABLE_EMPTY);
+		} else {
+			/* swap with the entry pending placement there, then place that entry */
+			lws_table_set_ctrl(t, j, entry->hash & 0x7f);
+			tmp = t->entries[j];
+			link = t->links[j];
+			lws_table_relink(&link);
+			t->entries[j] = *entry;
+			t->links[j] = t->links[i];
+			lws_table_relink(&t->links[j]);
+			t->entries[i] = tmp;
+			t->links[i] = link;
+			lws_table_relink(&t->links[i]);
+			i--;  /* wraps around for 0, as does the increment */
 		}
-		entry = &t->entries[h];
-	}
-	return NULL;
-}
-
-static lws_table_entry_t *lws_table_insert (lws_table_t *t, ngx_str_t *key, ngx_uint_t hash) {
-	size_t              h, q, len_worst, len, q_move, h_move, len_move, len_entry_move;
-	lws_table_entry_t  *entry, *entry_move, *entry_move_old, *entry_move_new;
-
-	/* Brent's method; source: https://maths-people.anu.edu.au/~brent/pd/rpb013.pdf */
-	/* determine worst case */
-	h = hash % t->alloc;
-	q = hash % (t->alloc - 2) + 1;
-	entry = &t->entries[h];
-	len_worst = 1;
-	while (entry->state == LWS_TES_SET) {
-		h = (h + q) % t->alloc;
-		entry = &t->entries[h];
-		len_worst++;
-	}
-	if (len_worst <= 2) {
-		/* "worst" case is optimal overall */
-		return entry;
-	}
-
-	/* check for a better overall outcome by moving conflicting entries */
-	entry_move_old = entry_move_new = NULL;
-	len_entry_move = (size_t)-1;
-	h = hash % t->alloc;
-	entry = &t->entries[h];
-	len = 1;
-	do {
-		q_move = entry->hash % (t->alloc - 2) + 1;
-		h_move = (h + q_move) % t->alloc;
-		entry_move = &t->entries[h_move];
-		len_move = 1;
-		while (1) {
-			if (entry_move->state != LWS_TES_SET) {
-				/* we found a better overall outcome */
-				entry_move_old = entry;
-				entry_move_new = entry_move;
-				len_entry_move = len_move;
-				break;
+	}
+	t->deleted = 0;
+}
+
+static lws_table_entry_t *lws_table_find (lws_table_t *t, ngx_str_t *key, ngx_uint_t *hash) {
+	size_t              mask, pos, step;
+	lws_table_mask_t    m;
+	lws_table_entry_t  *entry, *last;
+
+	/* small table; compare lengths first */
+	if (t->small) {
+		for (entry = t->entries, last = entry + t->count; entry < last; entry++) {
+			if (entry->key.len == key->len
+					&& (t->ci ? ngx_strncasecmp(entry->key.data, key->data, key->len)
+					: ngx_memcmp(entry->key.data, key->data, key->len)) == 0) {
+				return entry;
 			}
-			if (len + len_move >= len_worst - 1) {  /* zero-sum at best otherwise */
-				break;
+		}
+		return NULL;
+	}
+
+	/* SwissTable; source: https://abseil.io/about/design/swisstables */
+	*hash = lws_table_hash(t, key);
+	mask = t->alloc - 1;
+	pos = (*hash >> 7) & mask;
+	step = 0;
+	while (1) {
+		for (m = lws_table_match(&t->ctrl[pos], *hash & 0x7f); m; m &= m - 1) {
+			entry = &t->entries[(pos + lws_table_bit(m)) & mask];
+			if (entry->hash == *hash && entry->key.len == key->len
+					&& (t->ci ? ngx_strncasecmp(entry->key.data, key->data, key->len)
+					: ngx_memcmp(entry->key.data, key->data, key->len)) == 0) {
+				return entry;
 			}
-			h_move = (h_move + q_move) % t->alloc;
-			entry_move = &t->entries[h_move];
-			len_move++;
 		}
-		h = (h + q) % t->alloc;
-		entry = &t->entries[h];
-		len++;
-	} while (len < len_worst - 1 && len < len_entry_move);  /* zero-sum at best otherwise */
+		if (lws_table_match_empty(&t->ctrl[pos])) {
+			return NULL;
+		}
+		step += LWS_TABLE_GROUP;  /* triangular probing visits all groups */
+		pos = (pos + step) & mask;
+	}
+}
 
-	/* move if a better overall outcome was found */
-	if (entry_move_old) {  /* implied if len < len_entry_move is false */
-		*entry_move_new = *entry_move_old;
-		entry_move_new->order.prev->next = &entry_move_new->order;
-		entry_move_new->order.next->prev = &entry_move_new->order;
-		return entry_move_old;
-	}  /* len is invariably len_worst - 1 at this point */
+static size_t lws_table_probe (lws_table_t *t, ngx_uint_t hash) {
+	size_t            mask, pos, step;
+	lws_table_mask_t  m;
+
+	/* first empty or deleted slot on the probe sequence */
+	mask = t->alloc - 1;
+	pos = (hash >> 7) & mask;
+	step = 0;
+	while (1) {
+		m = lws_table_match_free(&t->ctrl[pos]);
+		if (m) {
+			return (pos + lws_table_bit(m)) & mask;
+		}
+		step += LWS_TABLE_GROUP;
+		pos = (pos + step) & mask;
+	}
+}
+
+static lws_table_entry_t *lws_table_insert (lws_table_t *t, ngx_uint_t hash) {
+	size_t  i;
+
+	i = lws_table_probe(t, hash);
+	if (t->ctrl[i] == LWS_TABLE_DELETED) {
+		t->deleted--;
+	}
+	lws_table_set_ctrl(t, i, hash & 0x7f);
+	return &t->entries[i];
+}
+
+static void lws_table_set_ctrl (lws_table_t *t, size_t i, u_char c) {
+	t->ctrl[i] = c;
+	if (i < LWS_TABLE_GROUP - 1) {
+		t->ctrl[t->alloc + i] = c;  /* copy for groups crossing the end */
+	}
+}
 
-	/* cannot do better than the worst case */
-	h = (h + q) % t->alloc;
-	entry = &t->entries[h];
-	return entry;
+static void lws_table_relink (lws_table_link_t *link) {
+	link->order.prev->next = &link->order;
+	link->order.next->prev = &link->order;
 }
 
 static void lws_table_remove (lws_table_t *t, lws_table_entry_t *entry) {
-	ngx_queue_remove(&entry->order);
+	size_t            i;
+	lws_table_mask_t  empty_before, empty_after;
+
+	i = entry - t->entries;
+	ngx_queue_remove(&t->links[i].order);
 	if (t->dup) {
 		ngx_free(entry->key.data);
 	}
 	if (t->free) {
 		ngx_free(entry->value);
 	}
-	entry->state = LWS_TES_DELETED;
 	t->count--;
+
+	/* small table; keep entries dense */
+	if (t->small) {
+		if (i != t->count) {
+			t->entries[i] = t->entries[t->count];
+			t->links[i] = t->links[t->count];
+			lws_table_relink(&t->links[i]);
+		}
+		return;
+	}
+
+	/* the slot can be empty, rather than deleted, if no probe window including it was ever
+	   without empty slots, i.e., no probe continued past it; a single group table always has
+	   an empty slot */
+	if (t->alloc > LWS_TABLE_GROUP) {
+		empty_before = lws_table_match_empty(&t->ctrl[(i - LWS_TABLE_GROUP) & (t->alloc - 1)]);
+		empty_after = lws_table_match_empty(&t->ctrl[i]);
+		if (!empty_before || !empty_after || lws_table_last_bits(empty_before)
+				+ lws_table_bit(empty_after) >= LWS_TABLE_GROUP) {
+			lws_table_set_ctrl(t, i, LWS_TABLE_DELETED);
+			t->deleted++;
+			return;
+		}
+	}
+	lws_table_set_ctrl(t, i, LWS_TABLE_EMPTY);
 }
@@ -15,13 +15,18 @@
 
 typedef struct lws_table_s lws_table_t;
 typedef struct lws_table_entry_s lws_table_entry_t;
+typedef struct lws_table_link_s lws_table_link_t;
 
 struct lws_table_s {
 	ngx_log_t           *log;       /* log */
-	size_t               alloc;     /* allocated slots */
-	size_t               load;      /* load limit for rehash */
+	size_t               alloc;     /* allocated slots; power of two, or 0 if small */
+	size_t               load;      /* load limit for rehash, including deleted slots */
 	size_t               count;     /* number of entries */
-	lws_table_entry_t   *entries;   /* entries */
+	size_t               deleted;   /* number of deleted slots */
+	u_char              *ctrl;      /* control bytes, one per slot, then a copy of the first
+	                                   group; empty, deleted, or the low 7 bits of the hash */
+	lws_table_entry_t   *entries;   /* entries, probed on lookup */
+	lws_table_link_t    *links;     /* links of entries, touched on update */
 	ngx_queue_t          order;     /* insert order; LRU if capped */
 	time_t               timeout;   /* timeout of entries */
 	size_t               cap;       /* cap */
@@ -30,21 +35,18 @@ struct lws_table_s {
 	unsigned             ci:1;      /* case insensitive */
 	unsigned             timed:1;   /* with timeout */
 	unsigned             capped:1;  /* capped, e.g., for caches */
+	unsigned             small:1;   /* linear, without hashing; entries and links inline */
 };
 
-typedef enum {
-	LWS_TES_UNUSED,
-	LWS_TES_SET,
-	LWS_TES_DELETED
-} lws_table_entry_state_e;
-
 struct lws_table_entry_s {
-	ngx_queue_t              order;  /* see above */
-	ngx_str_t                key;    /* key; managed if dup is set */
-	void                    *value;  /* value; managed if free is set */
-	ngx_uint_t               hash;   /* key hash */
-	time_t                   time;   /* set time; if timed is set */
-	lws_table_entry_state_e  state;  /* state [unused, set, deleted] */
+	ngx_str_t    key;    /* key; managed if dup is set */
+	void        *value;  /* value; managed if free is set */
+	ngx_uint_t   hash;   /* key hash */
+};
+
+struct lws_table_link_s {
+	ngx_queue_t  order;  /* see above */
+	time_t       time;   /* set time; if timed is set */
 };
 
 